@@ -19,6 +19,29 @@ const char* const firmwareVersion = VERSION_MAIN VERSION_DEBUG;
 // ************ This must be kept in step with the corresponding value in RepRapFirmware *************
 const uint32_t maxSpiFileData = 2048;
 
+// Define the largest data part of an SPI exchange that the SAM can select with networkSetMaxDataLength.
+// The ESP8266 has no DMA and little RAM to spare, so it stays at the default of 2048 bytes.
+#ifdef ESP8266
+const size_t MaxSpiDataLength = 2048;
+#else
+const size_t MaxSpiDataLength = 16384;
+#endif
+
+// Define the number of shared buffers that hold write data that lwIP could not accept, see Connection::Write.
+// Each one is allocated from the heap and holds a whole SPI data part of the length that the SAM has negotiated.
+#ifdef ESP8266
+const size_t NumWriteOverflowSlots = 1;
+#else
+const size_t NumWriteOverflowSlots = 2;
+#endif
+
+// Define how much heap to keep free for everything else when working out how much write data the SAM may send
+#ifdef ESP8266
+const size_t WriteHeapReserve = 8192;
+#else
+const size_t WriteHeapReserve = 16384;
+#endif
+
 // Define the SPI clock register
 // Useful values of the register are:
 // 0x1001	40MHz 1:1
@@ -66,6 +89,28 @@ const gpio_num_t OnboardLedPin = GPIO_NUM_32;
 
 const uint8_t Backlog = 8;
 
+const size_t NumQueuedJobs = 2;					// Wi-Fi jobs that may wait for the job task, enough for a networkStop behind a start
+
+// Rate limits on accepting incoming connections, so that a flood of them can't take the time we need to serve the SAM.
+// Each listener, and each of the most recent remote addresses, may open a burst of this many connections and then this many a second.
+const uint32_t ListenerAcceptBurst = 20;
+const uint32_t ListenerAcceptRate = 30;
+const uint32_t RemoteIpAcceptBurst = 10;
+const uint32_t RemoteIpAcceptRate = 10;
+const size_t NumRemoteIpBuckets = 8;			// how many remote addresses we keep limits for
+
+// How long sockets of each protocol (HTTP, FTP, Telnet, FTP data) may be idle before we reap them, in seconds. 0 means never.
+// Reaping frees sockets that the SAM still owns, so nothing is reaped until the SAM sets the timeouts with networkSetIdleTimeouts,
+// which tells us that it watches AllConnStatusResponse::reapedSockets.
+const uint16_t DefaultIdleTimeouts[] = { 0, 0, 0, 0 };
+
+// Define the number of connections we provide. Until the SAM selects more with networkSetNumSockets, only the first 8 are used.
+#ifdef CONFIG_DWSS_NUM_CONNECTIONS
+const size_t NumConnections = CONFIG_DWSS_NUM_CONNECTIONS;
+#else
+const size_t NumConnections = 8;
+#endif
+
 #define ARRAY_SIZE(_x) (sizeof(_x)/sizeof((_x)[0]))
 
 
@@ -86,6 +131,16 @@ const uint8_t Backlog = 8;
 #define WIFI_CONNECTION_PRIO					(MAIN_PRIO)
 #define TCP_LISTENER_PRIO						(ESP_TASK_TCPIP_PRIO)
 #define DNS_SERVER_PRIO							(ESP_TASK_MAIN_PRIO)
+#define NETWORK_JOB_PRIO						(ESP_TASK_MAIN_PRIO)		// below the main task, so that it keeps serving the SAM
+
+// On dual-core chips the main task serves the SAM on one core, and Wi-Fi, lwIP and our other tasks share the other one.
+// So the tasks that mostly wait for the tcpip task run on its core, and don't take time from the main task.
+#ifdef CONFIG_LWIP_TCPIP_TASK_AFFINITY
+#define CreateNetworkTask(_fn, _name, _stack, _arg, _prio, _hdl) \
+	xTaskCreatePinnedToCore(_fn, _name, _stack, _arg, _prio, _hdl, CONFIG_LWIP_TCPIP_TASK_AFFINITY)
+#else
+#define CreateNetworkTask(_fn, _name, _stack, _arg, _prio, _hdl)	xTaskCreate(_fn, _name, _stack, _arg, _prio, _hdl)
+#endif
 
 #ifdef DEBUG
 #define STATE_PRINT_STACK						(1024)
@@ -95,10 +150,12 @@ const uint8_t Backlog = 8;
 #define WIFI_CONNECTION_STACK					(1492)
 #define TCP_LISTENER_STACK  					(742)
 #define DNS_SERVER_STACK						(592)
+#define NETWORK_JOB_STACK						(1800)
 #else
 #define WIFI_CONNECTION_STACK					(2260)
 #define TCP_LISTENER_STACK	 					(1560)
 #define DNS_SERVER_STACK						(1360)
+#define NETWORK_JOB_STACK						(3072)
 #endif
 
 #endif
@@ -8,65 +8,243 @@
 #include <algorithm>			// for std::min
 
 #include "lwip/tcp.h"
+#include "lwip/stats.h"
+#include "lwip/dns.h"
+#include "lwip/priv/tcpip_priv.h"
+#include "esp_heap_caps.h"
+#include "esp_system.h"
 
 #include "Connection.h"
+#include "WriteOverflow.h"
 #include "Misc.h"				// for millis
 #include "Config.h"
 
-static_assert(MaxConnections < CONFIG_LWIP_MAX_SOCKETS); // Limits the listen callback value notification
+static_assert(NumConnections >= MaxConnections && NumConnections <= MaxWideConnections);
+static_assert(NumConnections < CONFIG_LWIP_MAX_SOCKETS); // there must be netconns left over for the listeners
+#ifdef CONFIG_LWIP_MAX_ACTIVE_TCP
+static_assert(NumConnections < CONFIG_LWIP_MAX_ACTIVE_TCP); // and pcbs for them
+#endif
 
 // Public interface
 Connection::Connection(uint8_t num)
-	: number(num), localPort(0), remotePort(0), remoteIp(0), conn(nullptr), state(ConnState::free),
-	closeTimer(0),readBuf(nullptr), readIndex(0), alreadyRead(0), pendOtherEndClosed(false)
+	: number(num), localPort(0), remotePort(0), remoteIp(0),
+#if CONFIG_DWSS_CONN_RAW_API
+	pcb(nullptr),
+#else
+	conn(nullptr),
+#endif
+	state(ConnState::free),
+	closeTimer(0),readBuf(nullptr), readBufTail(nullptr), readBufLength(0), readIndex(0), alreadyRead(0), pendOtherEndClosed(false),
+	rxRing(nullptr), rxRingSize(0), rxRingStart(0), rxRingCount(0),
+	overflow(nullptr), closeAfterOverflow(false), sendBufferLimit(0), ackThreshold(TCP_MSS),
+	connectedAt(0), lastRetransmits(0), lastActivity(0), idleState(ConnState::free), pollPending(false),
+	lookupState(Lookup::none), lookupId(0), connectTimer(0), connectTimeout(0),
+	reportedState(ConnState::free), reportedReadable(false), reportedWritable(false)
 {
+	ResetStats();
+#if CONFIG_DWSS_READ_PREFETCH_BUFFERS
+	stage = nullptr;
+	stageLength = 0;
+	lastRead = 0;
+#endif
+#if CONFIG_DWSS_CONN_RAW_API
+	txBuffer = nullptr;
+	ResetQueues();
+#endif
 }
 
 size_t Connection::Read(uint8_t *data, size_t length)
 {
-	size_t lengthRead = 0;
-	if (readBuf != nullptr && length != 0 && (state == ConnState::connected || state == ConnState::otherEndClosed))
+	SpiChunk chunks[MaxReadChunks];
+	size_t numChunks;
+	const size_t lengthRead = GetReadChunks(chunks, numChunks, MaxReadChunks, length);
+	size_t offset = 0;
+	for (size_t i = 0; i < numChunks; ++i)
 	{
-		do
+		memcpy(data + offset, chunks[i].data, chunks[i].length);
+		offset += chunks[i].length;
+	}
+	ConsumeRead(lengthRead);
+	return lengthRead;
+}
+
+// Describe up to 'length' bytes of the received data in place, so that they can be sent without copying them first.
+// Return the number of bytes described. The data stays valid until ConsumeRead is called.
+size_t Connection::GetReadChunks(SpiChunk *chunks, size_t& numChunks, size_t maxChunks, size_t length) const
+{
+	size_t lengthFound = 0;
+	numChunks = 0;
+	if (state == ConnState::connected || state == ConnState::otherEndClosed)
+	{
+		// The data in the receive ring is older than the data in the pbufs, and may wrap round
+		size_t ringOffset = rxRingStart;
+		while (lengthFound < rxRingCount && lengthFound < length && numChunks < maxChunks)
 		{
-			const size_t toRead = std::min<size_t>(readBuf->len - readIndex, length);
-			memcpy(data + lengthRead, (uint8_t *)readBuf->payload + readIndex, toRead);
-			lengthRead += toRead;
-			readIndex += toRead;
-			length -= toRead;
-			if (readIndex != readBuf->len)
+			const size_t toRead = std::min<size_t>(std::min<size_t>(rxRingCount - lengthFound, rxRingSize - ringOffset), length - lengthFound);
+			chunks[numChunks].data = rxRing + ringOffset;
+			chunks[numChunks].length = toRead;
+			++numChunks;
+			lengthFound += toRead;
+			ringOffset = 0;
+		}
+
+		size_t offset = readIndex;
+		for (const pbuf *pb = readBuf; pb != nullptr && lengthFound < length && numChunks < maxChunks; pb = pb->next)
+		{
+			const size_t toRead = std::min<size_t>(pb->len - offset, length - lengthFound);
+			if (toRead != 0)
 			{
-				break;
+				chunks[numChunks].data = (const uint8_t *)pb->payload + offset;
+				chunks[numChunks].length = toRead;
+				++numChunks;
+				lengthFound += toRead;
 			}
-			pbuf * const currentPb = readBuf;
-			readBuf = readBuf->next;
-			currentPb->next = nullptr;
-			pbuf_free(currentPb);
-			readIndex = 0;
-		} while (readBuf != nullptr && length != 0);
+			offset = 0;
+		}
+	}
+	return lengthFound;
+}
 
-		alreadyRead += lengthRead;
-		if (readBuf == nullptr || alreadyRead >= TCP_MSS)
+// Discard data that has been read, freeing the buffers that held it
+void Connection::ConsumeRead(size_t length)
+{
+	if (length == 0)
+	{
+		return;
+	}
+
+	const size_t lengthRead = length;
+	lastActivity = millis();
+#if CONFIG_DWSS_READ_PREFETCH_BUFFERS
+	lastRead = lastActivity;
+#endif
+	DropStage();						// the prefetched data no longer starts at the oldest unread byte
+	const size_t fromRing = std::min<size_t>(length, rxRingCount);
+	if (fromRing != 0)
+	{
+		rxRingCount -= fromRing;
+		rxRingStart = (rxRingCount == 0) ? 0 : (rxRingStart + fromRing) % rxRingSize;	// restart at the beginning when empty, to avoid wrapping
+		length -= fromRing;
+	}
+
+	while (readBuf != nullptr && length != 0)
+	{
+		const size_t toRead = std::min<size_t>(readBuf->len - readIndex, length);
+		readIndex += toRead;
+		readBufLength -= toRead;
+		length -= toRead;
+		if (readIndex != readBuf->len)
 		{
-			netconn_tcp_recvd(conn, alreadyRead);
-			alreadyRead = 0;
+			break;
 		}
+		FreeFirstPbuf();
+	}
+	FillRxRing();
+
+	// The receive window is only opened as the SAM takes the data, however long it spent in the ring
+	const bool allRead = (rxRingCount == 0 && readBuf == nullptr);
+	alreadyRead += lengthRead;
+	if (allRead || alreadyRead >= ackThreshold)
+	{
+#if CONFIG_DWSS_CONN_RAW_API
+		rxConsumed.store(rxConsumed.load(std::memory_order_relaxed) + alreadyRead, std::memory_order_release);
+		RequestService();
+#else
+		netconn_tcp_recvd(conn, alreadyRead);
+#endif
+		alreadyRead = 0;
+	}
+
+	if (allRead)
+	{
+		reportedReadable = false;			// so that more data arriving before the next poll is reported
+	}
+
+	if (pendOtherEndClosed && allRead)
+	{
+		pendOtherEndClosed = false;
+		SetState(ConnState::otherEndClosed);
+	}
+}
+
+size_t Connection::CanRead() const
+{
+	return (state == ConnState::connected || state == ConnState::otherEndClosed)
+			? rxRingCount + readBufLength : 0;
+}
+
+#if CONFIG_DWSS_READ_PREFETCH_BUFFERS
 
-		if (pendOtherEndClosed && !readBuf)
+// If the answer to a read of up to 'length' bytes has already been copied into a prefetch buffer, return the buffer and set 'amount'.
+// The caller must call ConsumeRead after queueing the data. The buffer is freed at once, but is not reused until PrefetchReads is next called.
+const uint32_t *Connection::GetStagedRead(size_t length, size_t& amount)
+{
+	// Only use the prefetched data if gathering the data now would not give the SAM any more
+	if (stage == nullptr || CanRead() == 0 || (length > stageLength && CanRead() > stageLength))
+	{
+		return nullptr;
+	}
+	const uint32_t * const buffer = stage;
+	amount = std::min<size_t>(length, stageLength);
+	freeStages[numFreeStages++] = stage;
+	stage = nullptr;
+	stageLength = 0;
+	++stagedReads;
+	return buffer;
+}
+
+// Copy the oldest received data on the readable sockets that the SAM read from most recently into the free prefetch buffers.
+// Called by the main task between transactions.
+/*static*/ void Connection::PrefetchReads()
+{
+	while (numFreeStages != 0)
+	{
+		Connection *best = nullptr;
+		for (size_t i = 0; i < numSockets; ++i)
 		{
-			pendOtherEndClosed = false;
-			SetState(ConnState::otherEndClosed);
+			Connection * const c = connectionList[i];
+			if (c->stage == nullptr && c->CanRead() != 0 && (best == nullptr || (int32_t)(c->lastRead - best->lastRead) > 0))
+			{
+				best = c;
+			}
 		}
+		if (best == nullptr)
+		{
+			break;
+		}
+
+		SpiChunk chunks[MaxReadChunks];
+		size_t numChunks;
+		uint32_t * const buffer = freeStages[--numFreeStages];
+		best->stageLength = best->GetReadChunks(chunks, numChunks, MaxReadChunks, MaxDataLength);
+		uint8_t *p = reinterpret_cast<uint8_t *>(buffer);
+		for (size_t i = 0; i < numChunks; ++i)
+		{
+			memcpy(p, chunks[i].data, chunks[i].length);
+			p += chunks[i].length;
+		}
+		best->stage = buffer;
 	}
-	return lengthRead;
 }
 
-size_t Connection::CanRead() const
+#endif
+
+// Give back the prefetch buffer, if this connection has one, because its data is no longer the oldest unread data
+void Connection::DropStage()
 {
-	return ((state == ConnState::connected || state == ConnState::otherEndClosed) && readBuf != nullptr)
-			? readBuf->tot_len - readIndex : 0;
+#if CONFIG_DWSS_READ_PREFETCH_BUFFERS
+	if (stage != nullptr)
+	{
+		freeStages[numFreeStages++] = stage;
+		stage = nullptr;
+		stageLength = 0;
+		++stagesDropped;
+	}
+#endif
 }
 
+#if !CONFIG_DWSS_CONN_RAW_API		// the raw API versions of the functions that use lwIP are in RawTcp.cpp
+
 // Write data to the connection. The amount of data may be zero.
 // A note about writing:
 // - LWIP is compiled with option LWIP_NETIF_TX_SINGLE_PBUF set. A comment says this is mandatory for the ESP8266.
@@ -78,12 +256,12 @@ size_t Connection::CanRead() const
 // - When it receives a write request from the Duet main processor, our socket server has to say how much data it can accept before accepting it.
 // - So in version 1.21 it sometimes happened that we accept some data based on the amount that tcp_sndbuf say we can, but we can't actually send it.
 // - We then terminate the connection, and the client request fails.
-// To mitigate this we could:
-// - Have one overflow write buffer, shared between all connections
-// - Only accept write data from the Duet main processor if the overflow buffer is free
-// - If after accepting data from the Duet main processor we find that we can't send it, we send some of it if we can and store the rest in the overflow buffer
-// - Then we push any pending data that we already have, and in Poll() we try to send the data in overflow buffer
-// - When the overflow buffer is empty again, we can start accepting write data from the Duet main processor again.
+// To mitigate this we:
+// - Have a small pool of overflow write buffers (class WriteOverflow), shared between all connections
+// - Only accept write data from the Duet main processor if an overflow buffer is free, and this connection isn't already using one
+// - If after accepting data from the Duet main processor we find that we can't send it, we send some of it if we can and store the rest in an overflow buffer
+// - Then in Poll() we try to send the data in the overflow buffer, and defer any close request until it has all been sent
+// - When the overflow buffer is empty again, we can start accepting write data for this connection from the Duet main processor again.
 // A further mitigation would be to restrict the amount of data we accept so some amount that will fit in the MSS, then tcp_write will need to allocate at most one PBUF.
 // However, another reason why tcp_write can fail is because MEMP_NUM_TCP_SEG is set too low in Lwip. It now appears that this is the maoin cause of files tcp_write
 // call in version 1.21. So I have increased it from 10 to 16, which seems to have fixed the problem..
@@ -95,8 +273,13 @@ size_t Connection::Write(const uint8_t *data, size_t length, bool doPush, bool c
 	}
 
 	// Try to send all the data
+	lastActivity = millis();
+	stats.bytesOut += length;
 	const bool push = doPush || closeAfterSending;
 
+	// The data must be copied even though the caller's buffer is not reused until we return. LWIP_NETIF_TX_SINGLE_PBUF
+	// makes tcp_write copy it into the segment regardless of this flag, and netconn has no call to queue a pbuf that we
+	// have filled ourselves, so receiving the SPI data phase straight into a pbuf would not save the copy.
 	u8_t flag = NETCONN_COPY | (push ? NETCONN_MORE : 0);
 
 	size_t total = 0;
@@ -107,6 +290,16 @@ size_t Connection::Write(const uint8_t *data, size_t length, bool doPush, bool c
 		written = 0;
 		rc = netconn_write_partly(conn, data + total, length - total, flag, &written);
 
+		if (rc == ERR_MEM || (rc == ERR_WOULDBLOCK && WriteOverflow::Available())) {
+			// lwIP can't take the rest of the data just now, so keep it in the overflow pool and send it from Poll()
+			overflow = WriteOverflow::Allocate(data + total, length - total, flag);
+			if (overflow != nullptr) {
+				++stats.overflows;
+				rc = ERR_OK;
+			}
+			break;
+		}
+
 		if (rc != ERR_OK && rc != ERR_WOULDBLOCK) {
 			break;
 		}
@@ -120,47 +313,164 @@ size_t Connection::Write(const uint8_t *data, size_t length, bool doPush, bool c
 		}
 		else
 		{
-			// We failed to write the data. See above for possible mitigations. For now we just terminate the connection.
+			// We failed to write the data and there was no overflow buffer to hold it, so we have to terminate the connection.
 			debugPrintfAlways("Write fail len=%u err=%d\n", total, (int)rc);
+			++stats.writeFailures;
 			Terminate(false);		// chrishamm: Not sure if this helps with LwIP v1.4.3 but it is mandatory for proper error handling with LwIP 2.0.3
 			return 0;
 		}
 	}
 
+	if (CanWrite() == 0)
+	{
+		reportedWritable = false;			// so that space becoming available before the next poll is reported
+	}
+
 	// Close the connection again when we're done
 	if (closeAfterSending)
 	{
-		Close();
+		Close();							// deferred until the overflow data has been sent, if there is any
 	}
 
 	return length;
 }
 
-size_t Connection::CanWrite() const
+// 'sharedSegments' is the result of SharedWriteSegments, which callers that check several connections in a row need only get once
+size_t Connection::CanWrite(size_t sharedSegments) const
 {
 	// Return the amount of free space in the write buffer
 	// Note: we cannot necessarily write this amount, because it depends on memory allocations being successful.
-	return ((state == ConnState::connected && !pendOtherEndClosed) && conn->pcb.tcp) ?
-		std::min((size_t)tcp_sndbuf(conn->pcb.tcp), MaxDataLength) : 0;
+	// So we only accept data when there is a free overflow slot to hold whatever lwIP fails to take, and while
+	// this connection's previous overflow data is still waiting, to keep the data in order.
+	if (!((state == ConnState::connected && !pendOtherEndClosed) && conn->pcb.tcp && overflow == nullptr && WriteOverflow::Available()))
+	{
+		return 0;
+	}
+
+	// tcp_sndbuf only accounts for the send window. Also limit the credit to what the segment queue and the heap
+	// that the segment pbufs are allocated from can hold. Each segment needs one queue entry and one pbuf,
+	// because LWIP_NETIF_TX_SINGLE_PBUF is set.
+	const struct tcp_pcb * const pcb = conn->pcb.tcp;
+	const size_t mss = tcp_mss(pcb);
+	const size_t queueFree = (tcp_sndqueuelen(pcb) < TCP_SND_QUEUELEN) ? TCP_SND_QUEUELEN - tcp_sndqueuelen(pcb) : 0;
+	size_t credit = std::min<size_t>(std::min((size_t)tcp_sndbuf(pcb), maxWriteLength), queueFree * mss);
+	credit = std::min<size_t>(credit, sharedSegments * mss);
+	return LimitWriteSpace(credit, (TCP_SND_BUF > tcp_sndbuf(pcb)) ? TCP_SND_BUF - tcp_sndbuf(pcb) : 0);
+}
+
+// Return each connected socket's fair share of the segments that the free heap, and the segment pool if we can see it, can hold
+/*static*/ size_t Connection::SharedWriteSegments()
+{
+	constexpr size_t SegmentOverhead = 128;			// pbuf and segment structures, protocol headers and heap overhead per segment
+
+	size_t numConnected = 0;
+	for (size_t i = 0; i < NumConnections; ++i)
+	{
+		if (connectionList[i]->state == ConnState::connected)
+		{
+			++numConnected;
+		}
+	}
+	numConnected = std::max<size_t>(numConnected, 1);
+
+	const size_t freeHeap = esp_get_free_heap_size();
+	size_t segments = (freeHeap > WriteHeapReserve) ? (freeHeap - WriteHeapReserve)/(TCP_MSS + SegmentOverhead) : 0;
+#if MEMP_STATS
+	const size_t segmentsUsed = lwip_stats.memp[MEMP_TCP_SEG]->used;
+	segments = std::min<size_t>(segments, (segmentsUsed < MEMP_NUM_TCP_SEG) ? MEMP_NUM_TCP_SEG - segmentsUsed : 0);
+#endif
+	return segments/numConnected;
+}
+
+// Set the options on the pcb. Like the socket options set in Connect, these are fields that lwIP reads when it next needs them.
+void Connection::ApplyOptions(const ConnOptionsData& options)
+{
+	if (conn->pcb.tcp)
+	{
+		SetPcbOptions(conn->pcb.tcp, options);
+	}
+}
+
+// Try to send the data that is waiting in the overflow pool
+void Connection::DrainOverflow()
+{
+	while (overflow->Remaining() != 0)
+	{
+		size_t written = 0;
+		const err_t rc = netconn_write_partly(conn, overflow->GetData(), overflow->Remaining(), overflow->GetFlags(), &written);
+		if (rc == ERR_OK && written != 0)
+		{
+			overflow->Consume(written);
+		}
+		else if (rc == ERR_OK || rc == ERR_MEM || rc == ERR_WOULDBLOCK)
+		{
+			return;							// try again next time we are polled
+		}
+		else if (rc == ERR_RST || rc == ERR_CLSD)
+		{
+			ReleaseOverflow();
+			SetState(ConnState::otherEndClosed);
+			return;
+		}
+		else
+		{
+			debugPrintfAlways("Overflow write fail len=%u err=%d\n", overflow->Remaining(), (int)rc);
+			++stats.writeFailures;
+			Terminate(false);
+			return;
+		}
+	}
+
+	ReleaseOverflow();
+	if (closeAfterOverflow)
+	{
+		closeAfterOverflow = false;
+		Close();
+	}
+}
+
+#endif
+
+void Connection::ReleaseOverflow()
+{
+	if (overflow != nullptr)
+	{
+		overflow->Release();
+		overflow = nullptr;
+	}
 }
 
+#if !CONFIG_DWSS_CONN_RAW_API
+
 void Connection::Poll()
 {
+	if (state == ConnState::connecting)
+	{
+		PollConnecting();
+		return;
+	}
+
+	if (overflow != nullptr && (state == ConnState::connected || state == ConnState::otherEndClosed))
+	{
+		DrainOverflow();
+	}
+
+	if (conn != nullptr && conn->pcb.tcp != nullptr)
+	{
+		SampleRetransmits(conn->pcb.tcp);
+	}
+
 	if ((state == ConnState::connected && !pendOtherEndClosed) || state == ConnState::otherEndClosed)
 	{
 		struct pbuf *data = nullptr;
 		err_t rc = netconn_recv_tcp_pbuf_flags(conn, &data, NETCONN_NOAUTORCVD);
 
 		while(rc == ERR_OK) {
-			if (readBuf == nullptr) {
-				readBuf = data;
-				readIndex = alreadyRead = 0;
-			} else {
-				pbuf_cat(readBuf, data);
-			}
+			AppendPbuf(data);
 			data = nullptr;
 			rc = netconn_recv_tcp_pbuf_flags(conn, &data, NETCONN_NOAUTORCVD);
 		}
+		FillRxRing();
 
 		if (rc != ERR_WOULDBLOCK)
 		{
@@ -172,7 +482,7 @@ void Connection::Poll()
 				// the connection state to other end closed first, then polls it when in fact it
 				// had data. By that time, the responder might have been already closed, leaving
 				// no one to consume this data and thus the socket unable to progress in state.
-				if (readBuf)
+				if (CanRead() != 0)
 				{
 					pendOtherEndClosed = true;
 				}
@@ -198,11 +508,13 @@ void Connection::Poll()
 		if (conn->pcb.tcp && !conn->pcb.tcp->unacked)
 		{
 			// All data has been received, close this connection next time
+			stats.closePendingMillis = millis() - closeTimer;
 			SetState(ConnState::closeReady);
 		}
 		else if (millis() - closeTimer >= MaxAckTime)
 		{
 			// The acknowledgement timer has expired, abort this connection
+			stats.closePendingMillis = millis() - closeTimer;
 			Terminate(false);
 		}
 	}
@@ -215,6 +527,12 @@ void Connection::Poll()
 // which will free it up.
 void Connection::Close()
 {
+	if (overflow != nullptr && (state == ConnState::connected || state == ConnState::otherEndClosed))
+	{
+		closeAfterOverflow = true;					// close when Poll() has sent the overflow data
+		return;
+	}
+
 	switch(state)
 	{
 	case ConnState::connected:						// both ends are still connected
@@ -236,8 +554,10 @@ void Connection::Close()
 			conn = nullptr;
 		}
 		FreePbuf();
+		ReleaseOverflow();
+		closeAfterOverflow = false;
 		SetState(ConnState::free);
-		listener->Notify();
+		Listener::Notify();
 		break;
 
 	case ConnState::closePending:					// we already asked to close
@@ -246,6 +566,8 @@ void Connection::Close()
 	}
 }
 
+#endif
+
 void Connection::Deallocate()
 {
 	if (state == ConnState::allocated)
@@ -254,7 +576,121 @@ void Connection::Deallocate()
 	}
 }
 
-bool Connection::Connect(uint8_t protocol, uint32_t remoteIp, uint16_t remotePort)
+// Arguments of the blocking call into the tcpip task that starts a name lookup. The call data must come first.
+struct LookupCall
+{
+	struct tcpip_api_call_data call;
+	const char *hostName;
+	ip_addr_t addr;
+	void *arg;
+};
+
+// Start to connect to the named host, or to remoteIp if hostName is empty.
+// The connection stays in the connecting state until it connects, or it is aborted because it failed or it took longer than timeout.
+// Return false if it failed straight away, in which case it is aborted already.
+bool Connection::Connect(uint8_t protocol, uint32_t remoteIp, uint16_t remotePort, const char *hostName, uint32_t timeout)
+{
+	this->protocol = protocol;
+	this->remoteIp = remoteIp;
+	this->remotePort = remotePort;
+	localPort = 0;
+	connectTimer = millis();
+	connectTimeout = (timeout != 0) ? timeout : DefaultConnectTimeout;
+	lookupState.store(Lookup::none, std::memory_order_relaxed);
+
+	if (hostName == nullptr || hostName[0] == 0)
+	{
+		return StartConnect();
+	}
+
+	// lwIP's resolver keeps recent answers until their TTL expires, so this usually finds the address without sending anything.
+	// If it has to ask the DNS server, LookupCallback gets the answer and PollConnecting carries on from there.
+	++lookupId;
+	LookupCall lc;
+	lc.hostName = hostName;
+	lc.arg = reinterpret_cast<void *>(static_cast<uintptr_t>((lookupId << 8) | number));
+	SetState(ConnState::connecting);
+	lookupState.store(Lookup::pending, std::memory_order_release);	// the callback may run before tcpip_api_call returns
+	const err_t rc = tcpip_api_call(DoLookup, &lc.call);
+	if (rc == ERR_OK)
+	{
+		lookupState.store(Lookup::none, std::memory_order_relaxed);
+		this->remoteIp = lc.addr.u_addr.ip4.addr;
+		return StartConnect();
+	}
+	if (rc == ERR_INPROGRESS)
+	{
+		return true;
+	}
+
+	lookupState.store(Lookup::none, std::memory_order_relaxed);
+	debugPrintfAlways("can't look up %s: %d\n", hostName, (int)rc);
+	SetState(ConnState::aborted);
+	return false;
+}
+
+// Called by Poll while the connection is connecting, to carry on after a name lookup and to give up when it takes too long
+void Connection::PollConnecting()
+{
+	switch (lookupState.load(std::memory_order_acquire))
+	{
+	case Lookup::found:
+		lookupState.store(Lookup::none, std::memory_order_relaxed);
+		StartConnect();
+		return;
+
+	case Lookup::failed:
+		lookupState.store(Lookup::none, std::memory_order_relaxed);
+		debugPrintAlways("host not found\n");
+		SetState(ConnState::aborted);
+		return;
+
+	default:
+		break;
+	}
+
+	if (millis() - connectTimer >= connectTimeout)
+	{
+		debugPrintfAlways("connect timeout to %u.%u.%u.%u\n", remoteIp & 255, (remoteIp >> 8) & 255, (remoteIp >> 16) & 255, (remoteIp >> 24) & 255);
+		lookupState.store(Lookup::none, std::memory_order_relaxed);
+		Terminate(false);
+	}
+}
+
+// Called in the tcpip task by Connect
+/*static*/ err_t Connection::DoLookup(struct tcpip_api_call_data *call)
+{
+	LookupCall * const lc = reinterpret_cast<LookupCall *>(call);
+	return dns_gethostbyname(lc->hostName, &lc->addr, LookupCallback, lc->arg);
+}
+
+// Called in the tcpip task when the DNS server has answered, or the lookup has timed out
+/*static*/ void Connection::LookupCallback(const char *name, const ip_addr_t *addr, void *arg)
+{
+	const uintptr_t tag = reinterpret_cast<uintptr_t>(arg);
+	const size_t num = tag & 0xFF;
+	Connection * const c = (num < NumConnections) ? connectionList[num] : nullptr;
+	if (c != nullptr && c->lookupId == (uint16_t)(tag >> 8) && c->state == ConnState::connecting
+		&& c->lookupState.load(std::memory_order_relaxed) == Lookup::pending)
+	{
+		if (addr != nullptr)
+		{
+			c->remoteIp = addr->u_addr.ip4.addr;
+			c->lookupState.store(Lookup::found, std::memory_order_release);
+		}
+		else
+		{
+			c->lookupState.store(Lookup::failed, std::memory_order_release);
+		}
+		c->pollPending = true;
+		WakePollTask();
+	}
+}
+
+#if !CONFIG_DWSS_CONN_RAW_API
+
+// Start to connect to remoteIp and remotePort
+bool Connection::StartConnect()
 {
 	struct netconn * conn = netconn_new_with_callback(NETCONN_TCP, ConnectCallback);
 
@@ -267,7 +703,6 @@ bool Connection::Connect(uint8_t protocol, uint32_t remoteIp, uint16_t remotePor
 		ip_set_option(conn->pcb.tcp, SOF_REUSEADDR);
 
 		this->conn = conn;
-		this->protocol = protocol;
 		SetState(ConnState::connecting);
 
 		ip_addr_t tempIp;
@@ -279,17 +714,17 @@ bool Connection::Connect(uint8_t protocol, uint32_t remoteIp, uint16_t remotePor
 		{
 			return true;
 		}
-		else
-		{
-			Terminate(true);
-		}
+
+		debugPrintfAlways("can't connect: %d\n", (int)rc);
+		Terminate(false);
 	}
 	else
 	{
 		debugPrintAlways("can't allocate connection\n");
+		SetState(ConnState::aborted);
 	}
 
-	return true;
+	return false;
 }
 
 void Connection::Terminate(bool external)
@@ -302,8 +737,10 @@ void Connection::Terminate(bool external)
 		conn = nullptr;
 	}
 	FreePbuf();
+	ReleaseOverflow();
+	closeAfterOverflow = false;
 	SetState((external) ? ConnState::free : ConnState::aborted);
-	listener->Notify();
+	Listener::Notify();
 }
 
 void Connection::Accept(Listener *listener, struct netconn* conn, uint8_t protocol)
@@ -320,26 +757,138 @@ void Connection::Connected(Listener *listener, struct netconn* conn)
 	remotePort = conn->pcb.tcp->remote_port;
 	remoteIp = conn->pcb.tcp->remote_ip.u_addr.ip4.addr;
 	readIndex = alreadyRead = closeTimer = pendOtherEndClosed = 0;
+	sendBufferLimit = 0;
+	ackThreshold = TCP_MSS;
+	ResetStats();
+	AllocateRxRing();
+	pollPending = true;			// lwIP may have queued data or a close before we had the netconn, and its events went unclaimed
 
 	// This function is used in lower priority tasks than the main task.
 	// Mark the connection ready last, so the main task does not use it when it's not ready.
 	// This should also be free from being taken by Connection::Allocate, since the previous
 	// state is not ConnState::free (Connection::Allocate sets the state to ConnState::allocated.).
 	SetState(ConnState::connected);
+	WakePollTask();
 }
 
-void Connection::GetStatus(ConnStatusResponse& resp) const
+#endif
+
+void Connection::GetStatus(ConnStatusResponse& resp, size_t sharedSegments) const
 {
 	resp.socketNumber = number;
 	resp.protocol = protocol;
 	resp.state = state;
 	resp.bytesAvailable = CanRead();
-	resp.writeBufferSpace = CanWrite();
+	resp.writeBufferSpace = CanWrite(sharedSegments);
 	resp.localPort = localPort;
 	resp.remotePort = remotePort;
 	resp.remoteIp = remoteIp;
 }
 
+// Append newly received data to the chain without walking it, as pbuf_cat would
+void Connection::AppendPbuf(struct pbuf *data)
+{
+	if (readBuf == nullptr)
+	{
+		readBuf = data;
+		readIndex = 0;
+	}
+	else
+	{
+		readBufTail->next = data;
+	}
+	readBufLength += data->tot_len;
+	lastActivity = millis();
+	if (stats.firstByteMillis == UINT32_MAX)
+	{
+		stats.firstByteMillis = lastActivity - connectedAt;
+	}
+	stats.bytesIn += data->tot_len;
+	for (const pbuf *pb = data; pb != nullptr; pb = pb->next)
+	{
+		++stats.pbufsIn;
+	}
+	for (readBufTail = data; readBufTail->next != nullptr; readBufTail = readBufTail->next) { }
+}
+
+// Set the options that the SAM sent with connSetOptions. Return false if the connection isn't open.
+bool Connection::SetOptions(const ConnOptionsData& options)
+{
+	if (!(state == ConnState::connected || state == ConnState::otherEndClosed))
+	{
+		return false;
+	}
+
+	sendBufferLimit = options.sendBufferLimit;
+	ackThreshold = (options.ackThreshold != 0) ? options.ackThreshold : TCP_MSS;
+	ApplyOptions(options);
+	return true;
+}
+
+void Connection::ResetStats()
+{
+	memset(&stats, 0, sizeof(stats));
+	stats.firstByteMillis = UINT32_MAX;
+	connectedAt = millis();
+	lastRetransmits = 0;
+}
+
+// lwIP only counts the retransmissions of the oldest unacknowledged segment, and resets the count when it is acknowledged.
+// So add up the increases each time we look, which misses any retransmissions of a segment between looking and its acknowledgement.
+void Connection::SampleRetransmits(const struct tcp_pcb *pcb)
+{
+	if (pcb->nrtx > lastRetransmits)
+	{
+		stats.retransmits += pcb->nrtx - lastRetransmits;
+	}
+	lastRetransmits = pcb->nrtx;
+}
+
+// Reduce the write space that we report so that no more than sendBufferLimit is waiting, if the SAM has set a limit
+size_t Connection::LimitWriteSpace(size_t space, size_t waiting) const
+{
+	if (sendBufferLimit == 0)
+	{
+		return space;
+	}
+	return (waiting < sendBufferLimit) ? std::min<size_t>(space, sendBufferLimit - waiting) : 0;
+}
+
+/*static*/ void Connection::SetPcbOptions(struct tcp_pcb *pcb, const ConnOptionsData& options)
+{
+	if (options.flags & ConnOptionsData::FlagNoDelay)
+	{
+		tcp_nagle_disable(pcb);
+	}
+	else
+	{
+		tcp_nagle_enable(pcb);
+	}
+
+	if (options.flags & ConnOptionsData::FlagKeepAlive)
+	{
+		ip_set_option(pcb, SOF_KEEPALIVE);
+#if LWIP_TCP_KEEPALIVE
+		if (options.keepAliveIdle != 0)
+		{
+			pcb->keep_idle = options.keepAliveIdle;
+		}
+		if (options.keepAliveInterval != 0)
+		{
+			pcb->keep_intvl = options.keepAliveInterval;
+		}
+		if (options.keepAliveCount != 0)
+		{
+			pcb->keep_cnt = options.keepAliveCount;
+		}
+#endif
+	}
+	else
+	{
+		ip_reset_option(pcb, SOF_KEEPALIVE);
+	}
+}
+
 void Connection::FreePbuf()
 {
 	if (readBuf != nullptr)
@@ -347,6 +896,77 @@ void Connection::FreePbuf()
 		pbuf_free(readBuf);
 		readBuf = nullptr;
 	}
+	readBufTail = nullptr;
+	readBufLength = 0;
+	FreeRxRing();
+	DropStage();
+
+#if CONFIG_DWSS_CONN_RAW_API
+	// The pcb has gone, so nothing more can be queued
+	for (size_t i = rxQueueOut.load(std::memory_order_relaxed); i != rxQueueIn.load(std::memory_order_acquire); ++i)
+	{
+		pbuf_free(rxQueue[i % RawRxQueueLength]);
+	}
+	rxQueueOut.store(rxQueueIn.load(std::memory_order_relaxed), std::memory_order_release);
+#endif
+}
+
+// Free the first pbuf in the chain, which has been read
+void Connection::FreeFirstPbuf()
+{
+	pbuf * const currentPb = readBuf;
+	readBuf = readBuf->next;
+	if (readBuf == nullptr)
+	{
+		readBufTail = nullptr;
+	}
+	currentPb->next = nullptr;
+	pbuf_free(currentPb);
+	readIndex = 0;
+}
+
+// Get a receive ring for a connection that has just been made.
+// Without a ring, or if we can't get one, received data just stays in its pbufs until it is read.
+void Connection::AllocateRxRing()
+{
+#if CONFIG_DWSS_CONN_RX_RING_SIZE
+	rxRingStart = rxRingCount = 0;
+	if (rxRing == nullptr)
+	{
+		rxRing = (uint8_t *)heap_caps_malloc(CONFIG_DWSS_CONN_RX_RING_SIZE, MALLOC_CAP_DMA | MALLOC_CAP_8BIT);
+	}
+	rxRingSize = (rxRing != nullptr) ? CONFIG_DWSS_CONN_RX_RING_SIZE : 0;
+#endif
+}
+
+// Give the receive ring back to the heap once the connection has finished with it, so that only connected sockets hold one
+void Connection::FreeRxRing()
+{
+	if (rxRing != nullptr)
+	{
+		heap_caps_free(rxRing);
+		rxRing = nullptr;
+	}
+	rxRingSize = rxRingStart = rxRingCount = 0;
+}
+
+// Copy as much received data as will fit into the receive ring, so that the pbufs holding it can be freed straight away
+void Connection::FillRxRing()
+{
+	while (readBuf != nullptr && rxRingCount < rxRingSize)
+	{
+		const size_t end = (rxRingStart + rxRingCount) % rxRingSize;
+		const size_t space = std::min<size_t>(rxRingSize - rxRingCount, rxRingSize - end);
+		const size_t toCopy = std::min<size_t>(readBuf->len - readIndex, space);
+		memcpy(rxRing + end, (const uint8_t *)readBuf->payload + readIndex, toCopy);
+		rxRingCount += toCopy;
+		readBufLength -= toCopy;
+		readIndex += toCopy;
+		if (readIndex == readBuf->len)
+		{
+			FreeFirstPbuf();
+		}
+	}
 }
 
 void Connection::Report()
@@ -364,11 +984,14 @@ void Connection::Report()
 		"closeReady"			// about to be closed
 	};
 
-	const unsigned int st = (int)state;
+	const unsigned int st = (unsigned int)GetState();
 	ets_printf("%s", (st < ARRAY_SIZE(connStateText)) ? connStateText[st]: "unknown");
 	if (state != ConnState::free)
 	{
 		ets_printf(" %u, %u, %u.%u.%u.%u", localPort, remotePort, remoteIp & 255, (remoteIp >> 8) & 255, (remoteIp >> 16) & 255, (remoteIp >> 24) & 255);
+		ets_printf(" in %u/%u out %u fail %u ovf %u ttfb %d cp %u rtx %u",
+					stats.bytesIn, stats.pbufsIn, stats.bytesOut, stats.writeFailures, stats.overflows,
+					(stats.firstByteMillis == UINT32_MAX) ? -1 : (int)stats.firstByteMillis, stats.closePendingMillis, stats.retransmits);
 	}
 }
 
@@ -376,88 +999,391 @@ void Connection::Report()
 
 /*static*/ void Connection::Init()
 {
-	allocateMutex = xSemaphoreCreateMutex();
+	static_assert(ARRAY_SIZE(DefaultIdleTimeouts) == NumProtocols);
+	memcpy(idleTimeouts, DefaultIdleTimeouts, sizeof(idleTimeouts));
+#if !CONFIG_DWSS_CONN_RAW_API
+	WriteOverflow::Init();
+#endif
 
-	for (size_t i = 0; i < MaxConnections; ++i)
+	for (size_t i = 0; i < NumConnections; ++i)
 	{
 		connectionList[i] = new Connection((uint8_t)i);
+#if CONFIG_DWSS_CONN_RAW_API
+		connectionList[i]->txBuffer = (uint8_t *)malloc(RawTxBufferSize);
+#endif
+	}
+
+#if CONFIG_DWSS_READ_PREFETCH_BUFFERS
+	for (size_t i = 0; i < CONFIG_DWSS_READ_PREFETCH_BUFFERS; ++i)
+	{
+		// Prefetching is skipped if we can't get the buffers
+		uint32_t * const buffer = (uint32_t *)heap_caps_malloc(MaxDataLength, MALLOC_CAP_DMA | MALLOC_CAP_32BIT);
+		if (buffer != nullptr)
+		{
+			freeStages[numFreeStages++] = buffer;
+		}
 	}
+#endif
 }
 
-/*static*/ void Connection::PollAll()
+// Record the events that have happened on this connection since it was last polled. Return true if there are any.
+bool Connection::RecordEvents(size_t sharedSegments)
 {
-	for (size_t i = 0; i < MaxConnections; ++i)
+	const uint32_t mask = 1u << number;
+	bool newEvents = false;
+
+	const ConnState st = state;
+	if (st != reportedState)
 	{
-		Connection::Get(i).Poll();
+		if (st == ConnState::connected)
+		{
+			eventsConnected |= mask;
+			reportedReadable = reportedWritable = false;
+			newEvents = true;
+		}
+		else if (st == ConnState::otherEndClosed || st == ConnState::aborted)
+		{
+			eventsClosed |= mask;
+			newEvents = true;
+		}
+		else { }
+		reportedState = st;
 	}
+
+	const bool readable = (CanRead() != 0);
+	if (readable && !reportedReadable)
+	{
+		eventsReadable |= mask;
+		newEvents = true;
+	}
+	reportedReadable = readable;
+
+	const bool writable = (CanWrite(sharedSegments) != 0);
+	if (writable && !reportedWritable)
+	{
+		eventsWritable |= mask;
+		newEvents = true;
+	}
+	reportedWritable = writable;
+
+	return newEvents;
+}
+
+// Reap this connection if it has been idle for longer than its protocol allows.
+// A connected one is aborted, so that the SAM sees it has gone. If the SAM then leaves it, it is freed after the same time again.
+void Connection::CheckIdle(uint32_t now)
+{
+	if (state != idleState)
+	{
+		idleState = state;
+		lastActivity = now;
+		return;
+	}
+
+	const uint32_t timeout = (protocol < NumProtocols) ? idleTimeouts[protocol] * 1000 : 0;
+	if (timeout == 0 || now - lastActivity < timeout)
+	{
+		return;
+	}
+
+	switch (state)
+	{
+	case ConnState::connected:
+	case ConnState::otherEndClosed:
+	case ConnState::aborted:
+		debugPrintfAlways("reaping idle socket %u in state %u\n", number, (unsigned int)GetState());
+		Terminate(state != ConnState::connected);		// free it unless it was still connected
+		reapedSockets |= 1u << number;
+		eventsClosed |= 1u << number;
+		++timesReaped;
+		break;
+
+	default:
+		break;
+	}
+}
+
+// Return true if Poll() has anything to do. Receiving and errors are signalled by the netconn callback,
+// but the close timers and any overflow data need attention on every pass.
+bool Connection::NeedsPoll() const
+{
+	switch (state)
+	{
+	case ConnState::connected:
+	case ConnState::otherEndClosed:
+#if CONFIG_DWSS_CONN_RAW_API
+		// Write data that lwIP had no room for needs another service request
+		return pollPending || txOut.load(std::memory_order_relaxed) != txIn.load(std::memory_order_relaxed);
+#else
+		return pollPending || overflow != nullptr;
+#endif
+
+	case ConnState::connecting:						// to time out the connection or carry on after a name lookup
+	case ConnState::closePending:
+	case ConnState::closeReady:
+		return true;
+
+	default:
+		return false;
+	}
+}
+
+// Return how many milliseconds may pass before this connection needs polling again, or UINT32_MAX if only an event can make it need polling
+uint32_t Connection::PollDelay(uint32_t now) const
+{
+	if (pollPending || state != idleState)
+	{
+		return 0;
+	}
+
+	// How long until an interval that started at 'start' has passed
+	auto until = [now](uint32_t start, uint32_t interval) -> uint32_t
+		{
+			const uint32_t elapsed = now - start;
+			return (elapsed >= interval) ? 0 : interval - elapsed;
+		};
+
+	uint32_t delay = UINT32_MAX;
+	switch (state)
+	{
+	case ConnState::connecting:
+		delay = until(connectTimer, connectTimeout);
+		break;
+
+	case ConnState::closeReady:
+		return 0;
+
+	case ConnState::closePending:
+		// Nothing tells us when the remaining data has been acknowledged, so keep looking until MaxAckTime
+		delay = std::min<uint32_t>(until(closeTimer, MaxAckTime), RetryPollMillis);
+		break;
+
+	case ConnState::connected:
+	case ConnState::otherEndClosed:
+		if (NeedsPoll())
+		{
+			delay = RetryPollMillis;			// write data is waiting for room in lwIP, which may come from another connection freeing memory
+		}
+		break;
+
+	default:
+		break;
+	}
+
+	const uint32_t timeout = (protocol < NumProtocols) ? idleTimeouts[protocol] * 1000 : 0;
+	if (timeout != 0 && (state == ConnState::connected || state == ConnState::otherEndClosed || state == ConnState::aborted))
+	{
+		delay = std::min<uint32_t>(delay, until(lastActivity, timeout));
+	}
+	return delay;
+}
+
+// Return how many milliseconds the poll task may sleep before a connection needs polling, or UINT32_MAX if only an event can make one need it
+/*static*/ uint32_t Connection::NextPollDelay()
+{
+	const uint32_t now = millis();
+	uint32_t delay = UINT32_MAX;
+	for (size_t i = 0; i < NumConnections; ++i)
+	{
+		delay = std::min<uint32_t>(delay, connectionList[i]->PollDelay(now));
+	}
+	return delay;
+}
+
+// Set the task that calls PollAll, and the notification bits that wake it
+/*static*/ void Connection::SetPollTask(TaskHandle_t task, uint32_t notifyBits)
+{
+	pollNotifyBits = notifyBits;
+	pollTask = task;
+}
+
+// Called by lwIP callbacks and other tasks after they have set pollPending or changed the state of a connection
+/*static*/ void Connection::WakePollTask()
+{
+	if (pollTask != nullptr)
+	{
+		xTaskNotify(pollTask, pollNotifyBits, eSetBits);
+	}
+}
+
+// Poll the connections that need it. Return true if there are new events for the SAM to fetch.
+/*static*/ bool Connection::PollAll()
+{
+	bool newEvents = false;
+	const uint32_t now = millis();
+#if CONFIG_DWSS_CONN_RAW_API
+	Listener::ReapStopped();
+#endif
+	for (size_t i = 0; i < NumConnections; ++i)
+	{
+		Connection& c = Connection::Get(i);
+		c.CheckIdle(now);
+		if (c.NeedsPoll())
+		{
+			c.pollPending = false;			// clear it first, so that an event that arrives while we poll is not lost
+			c.Poll();
+			++pollsDone;
+		}
+		else
+		{
+			++pollsSkipped;
+		}
+	}
+
+	// SAM firmware that never fetches the events would never clear them, so only record them once it has
+	if (eventsEnabled)
+	{
+		// Write space can change without an event on a connection, e.g. when another one drained its overflow data above,
+		// so share out the segments only after all the polls and check every connection.
+		const size_t sharedSegments = SharedWriteSegments();
+		for (size_t i = 0; i < NumConnections; ++i)
+		{
+			if (Connection::Get(i).RecordEvents(sharedSegments))
+			{
+				newEvents = true;
+			}
+		}
+	}
+	return newEvents;
 }
 
 /*static*/ void Connection::TerminateAll()
 {
-	for (size_t i = 0; i < MaxConnections; ++i)
+	for (size_t i = 0; i < NumConnections; ++i)
 	{
 		Connection::Get(i).Terminate(true);
 	}
 }
 
 
+// Set the most data that the SAM can send in one write, when it negotiates a new data length
+/*static*/ void Connection::SetMaxWriteLength(size_t length)
+{
+	maxWriteLength = length;
+#if !CONFIG_DWSS_CONN_RAW_API
+	WriteOverflow::SetSlotSize(length);			// the overflow pool may have to hold all of a write
+#endif
+}
+
+/*static*/ void Connection::SetIdleTimeouts(const IdleTimeoutsData& data)
+{
+	for (size_t i = 0; i < NumProtocols; ++i)
+	{
+		idleTimeouts[i] = data.timeouts[i];
+	}
+}
+
+// Return the sockets that have been reaped since we were last called
+/*static*/ uint32_t Connection::TakeReapedSockets()
+{
+	const uint32_t reaped = reapedSockets;
+	reapedSockets = 0;
+	return reaped;
+}
+
+// Set the number of connections that the SAM is using. Connections above a reduced limit are terminated.
+/*static*/ void Connection::SetNumSockets(size_t num)
+{
+	const size_t oldNum = numSockets;
+	numSockets = num;							// Allocate checks this again after it takes a connection
+
+	for (size_t i = num; i < oldNum; ++i)
+	{
+		Connection::Get(i).Terminate(true);
+	}
+}
+
 /*static*/ void Connection::ReportConnections()
 {
 	ets_printf("Conns");
-	for (size_t i = 0; i < MaxConnections; ++i)
+	for (size_t i = 0; i < NumConnections; ++i)
 	{
 		ets_printf("%c %u:", (i == 0) ? ':' : ',', i);
 		connectionList[i]->Report();
 	}
 	ets_printf("\n");
+	ets_printf("Polls: %u done, %u skipped, idle sockets reaped %u\n", pollsDone, pollsSkipped, timesReaped);
+#if CONFIG_DWSS_CONN_RAW_API
+	ets_printf("Raw API: receive queue full %u times\n", rxQueueFull);
+#endif
+#if CONFIG_DWSS_READ_PREFETCH_BUFFERS
+	ets_printf("Read prefetch: %u reads answered, %u buffers dropped, %u buffers free\n", stagedReads, stagesDropped, numFreeStages);
+#endif
+	WriteOverflow::Report();
+	Listener::Report();
+}
+
+// Return the events that have not yet been fetched, and clear them. The first call turns on recording the events.
+/*static*/ void Connection::GetEvents(ConnEventsResponse& resp)
+{
+	eventsEnabled = true;
+	resp.connectedSockets = eventsConnected;
+	resp.readableSockets = eventsReadable;
+	resp.writableSockets = eventsWritable;
+	resp.closedSockets = eventsClosed;
+	eventsConnected = eventsReadable = eventsWritable = eventsClosed = 0;
 }
 
-/*static*/ void Connection::GetSummarySocketStatus(uint16_t& connectedSockets, uint16_t& otherEndClosedSockets)
+/*static*/ void Connection::GetSummarySocketStatus(uint32_t& connectedSockets, uint32_t& otherEndClosedSockets)
 {
 	connectedSockets = 0;
 	otherEndClosedSockets = 0;
-	for (size_t i = 0; i < MaxConnections; ++i)
+	for (size_t i = 0; i < NumConnections; ++i)
 	{
 		if (Connection::Get(i).GetState() == ConnState::connected)
 		{
-			connectedSockets |= (1 << i);
+			connectedSockets |= (1u << i);
 		}
 		else if (Connection::Get(i).GetState() == ConnState::otherEndClosed)
 		{
-			otherEndClosedSockets |= (1 << i);
+			otherEndClosedSockets |= (1u << i);
 		}
 		else { }
 	}
 }
 
-/*static*/ Connection *Connection::Allocate()
+// Take the connection if it is free
+bool Connection::TryAllocate()
 {
-	Connection *conn = nullptr;
+#ifdef ESP8266
+	taskENTER_CRITICAL();
+	const bool wasFree = (state == ConnState::free);
+	if (wasFree)
+	{
+		state = ConnState::allocated;
+	}
+	taskEXIT_CRITICAL();
+	return wasFree;
+#else
+	ConnState expected = ConnState::free;
+	return state.compare_exchange_strong(expected, ConnState::allocated);
+#endif
+}
 
-	// This sequence must be protected with a mutex, since it happens on
-	// both ConnectionTask and the main task, the latter having lower
-	// priority. If for example, this is executing on main task
-	// specifically after the state == free check, at which point is
-	// pre-empted by the ConnectionTask executing the same code, the allocated
-	// Connection will have been already spent.
-	xSemaphoreTake(allocateMutex, portMAX_DELAY);
-	for (size_t i = 0; i < MaxConnections; ++i)
+// This is called by the main task, and by the listener task or the tcpip task when they accept a connection.
+// Taking a connection is a single atomic change of its state, so none of them has to wait for another.
+/*static*/ Connection *Connection::Allocate()
+{
+	for (size_t i = 0; i < numSockets; ++i)
 	{
-		if (connectionList[i]->state == ConnState::free)
+		Connection * const conn = connectionList[i];
+		if (conn->state == ConnState::free && conn->TryAllocate())
 		{
-			conn = connectionList[i];
-			conn->SetState(ConnState::allocated);
+			if (i < numSockets)
+			{
+				return conn;
+			}
+			conn->SetState(ConnState::free);		// SetNumSockets has just reduced the number of connections in use
 			break;
 		}
 	}
-	xSemaphoreGive(allocateMutex);
-	return conn;
+	return nullptr;
 }
 
 /*static*/ uint16_t Connection::CountConnectionsOnPort(uint16_t port)
 {
 	uint16_t count = 0;
-	for (size_t i = 0; i < MaxConnections; ++i)
+	for (size_t i = 0; i < NumConnections; ++i)
 	{
 		if (connectionList[i]->localPort == port)
 		{
@@ -471,6 +1397,22 @@ void Connection::Report()
 	return count;
 }
 
+// Count the sockets that the SAM is using that are free for a new connection
+/*static*/ size_t Connection::CountFreeSockets()
+{
+	size_t count = 0;
+	for (size_t i = 0; i < numSockets; ++i)
+	{
+		if (connectionList[i]->state == ConnState::free)
+		{
+			++count;
+		}
+	}
+	return count;
+}
+
+#if !CONFIG_DWSS_CONN_RAW_API
+
 /*static*/ void Connection::ConnectCallback(struct netconn *conn, enum netconn_evt evt, u16_t len)
 {
 	for (Connection *connection : connectionList)
@@ -485,16 +1427,62 @@ void Connection::Report()
 
 			case NETCONN_EVT_ERROR:
 				connection->SetState(ConnState::otherEndClosed);
+				WakePollTask();
 				break;
 			default:
 				break;
 			}
+			return;
+		}
+	}
+	NetconnEvent(conn, evt);
+}
+
+// Called in the tcpip task when lwIP has queued something on a connection's netconn, or it can accept more data.
+// Accepted connections inherit the listener's callback, which passes their events on to here.
+/*static*/ void Connection::NetconnEvent(struct netconn *conn, enum netconn_evt evt)
+{
+	if (evt == NETCONN_EVT_RCVPLUS || evt == NETCONN_EVT_SENDPLUS || evt == NETCONN_EVT_ERROR)
+	{
+		for (Connection *connection : connectionList)
+		{
+			if (connection && connection->conn == conn)
+			{
+				connection->pollPending = true;
+				WakePollTask();
+				break;
+			}
 		}
 	}
 }
 
+#endif
+
 // Static data
-SemaphoreHandle_t Connection::allocateMutex = nullptr;
-Connection *Connection::connectionList[MaxConnections];
+Connection *Connection::connectionList[NumConnections];
+volatile size_t Connection::numSockets = MaxConnections;
+size_t Connection::maxWriteLength = MaxDataLength;
+uint32_t Connection::eventsConnected = 0;
+uint32_t Connection::eventsReadable = 0;
+bool Connection::eventsEnabled = false;
+uint32_t Connection::eventsWritable = 0;
+uint32_t Connection::eventsClosed = 0;
+uint16_t Connection::idleTimeouts[NumProtocols];
+uint32_t Connection::reapedSockets = 0;
+uint32_t Connection::timesReaped = 0;
+uint32_t Connection::pollsDone = 0;
+uint32_t Connection::pollsSkipped = 0;
+TaskHandle_t Connection::pollTask = nullptr;
+uint32_t Connection::pollNotifyBits = 0;
+#if CONFIG_DWSS_CONN_RAW_API
+std::atomic<bool> Connection::serviceQueued(false);
+uint32_t Connection::rxQueueFull = 0;
+#endif
+#if CONFIG_DWSS_READ_PREFETCH_BUFFERS
+uint32_t *Connection::freeStages[CONFIG_DWSS_READ_PREFETCH_BUFFERS];
+size_t Connection::numFreeStages = 0;
+uint32_t Connection::stagedReads = 0;
+uint32_t Connection::stagesDropped = 0;
+#endif
 
 // End
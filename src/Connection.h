@@ -12,18 +12,40 @@
 
 #include <cstdint>
 #include <cstddef>
+#include <atomic>
 
 #include "Config.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/queue.h"
-#include "freertos/semphr.h"
 #include "lwip/api.h"
 
 #include "include/MessageFormats.h"			// for ConnState
 #include "Listener.h"
+#include "HSPI.h"								// for SpiChunk
+
+class WriteOverflow;
+struct tcpip_api_call_data;
 
 constexpr uint32_t MaxReadWriteTime = 2000;		// how long we wait for a write operation to complete before it is cancelled
 constexpr uint32_t MaxAckTime = 4000;			// how long we wait for a connection to acknowledge the remaining data before it is closed
+constexpr uint32_t DefaultConnectTimeout = 10000;	// how long we wait for an outgoing connection, including the name lookup, unless the SAM says otherwise
+constexpr uint32_t RetryPollMillis = 10;			// how often we poll for work that no event tells us about, e.g. a close waiting for acknowledgements
+constexpr size_t MaxReadChunks = 8;				// the most received buffers that one read sends from without copying them
+
+#if CONFIG_DWSS_CONN_RAW_API
+constexpr size_t RawRxQueueLength = 16;			// the most received pbuf chains that the tcpip task can queue for the main task
+constexpr size_t RawTxBufferSize = CONFIG_DWSS_CONN_RAW_TX_BUFFER_SIZE;
+static_assert((RawRxQueueLength & (RawRxQueueLength - 1)) == 0 && (RawTxBufferSize & (RawTxBufferSize - 1)) == 0,
+				"the raw API queue sizes must be powers of 2, so that the free running indices wrap correctly");
+#endif
+
+// The main task, the listener task and the tcpip task all allocate connections, so the state is changed from free with a compare-and-swap.
+// The ESP8266 has a single core and no compare-and-swap instruction, so there it is done with interrupts disabled instead.
+#ifdef ESP8266
+typedef volatile ConnState ConnStateVar;
+#else
+typedef std::atomic<ConnState> ConnStateVar;
+#endif
 
 class Connection
 {
@@ -34,32 +56,60 @@ public:
 
 	// Public interface
 	size_t Read(uint8_t *data, size_t length);
+	size_t GetReadChunks(SpiChunk *chunks, size_t& numChunks, size_t maxChunks, size_t length) const;
+	void ConsumeRead(size_t length);
 	size_t CanRead() const;
+#if CONFIG_DWSS_READ_PREFETCH_BUFFERS
+	const uint32_t *GetStagedRead(size_t length, size_t& amount);
+#endif
 	size_t Write(const uint8_t *data, size_t length, bool doPush, bool closeAfterSending);
-	size_t CanWrite() const;
+	size_t CanWrite() const { return CanWrite(SharedWriteSegments()); }
+	size_t CanWrite(size_t sharedSegments) const;
 
-	bool Connect(uint8_t protocol, uint32_t remoteIp, uint16_t remotePort);
+	bool Connect(uint8_t protocol, uint32_t remoteIp, uint16_t remotePort, const char *hostName, uint32_t timeout);
 	void Close();
 	void Terminate(bool external);
 	void Deallocate();
-	void GetStatus(ConnStatusResponse& resp) const;
+	void GetStatus(ConnStatusResponse& resp) const { GetStatus(resp, SharedWriteSegments()); }
+	void GetStatus(ConnStatusResponse& resp, size_t sharedSegments) const;
+	bool SetOptions(const ConnOptionsData& options);
+	void GetStats(ConnStatsResponse& resp) const { resp = stats; }
 	uint8_t GetNum() { return number; }
 
 	// Static functions
 	static Connection *Allocate();
 
 	static void Init();
-	static void PollAll();
+	static bool PollAll();
+	static uint32_t NextPollDelay();
+	static void SetPollTask(TaskHandle_t task, uint32_t notifyBits);
 	static void TerminateAll();
 
 	static Connection& Get(uint8_t num) { return *connectionList[num]; }
-	static void GetSummarySocketStatus(uint16_t& connectedSockets, uint16_t& otherEndClosedSockets);
+	static void SetMaxWriteLength(size_t length);
+	static void GetSummarySocketStatus(uint32_t& connectedSockets, uint32_t& otherEndClosedSockets);
+	static size_t GetNumSockets() { return numSockets; }
+	static size_t SharedWriteSegments();
+	static void SetNumSockets(size_t num);
+	static void SetIdleTimeouts(const IdleTimeoutsData& data);
+	static uint32_t TakeReapedSockets();
+	static void GetEvents(ConnEventsResponse& resp);
+	static bool EventsPending() { return (eventsConnected | eventsReadable | eventsWritable | eventsClosed) != 0; }
 	static void ReportConnections();
+#if CONFIG_DWSS_READ_PREFETCH_BUFFERS
+	static void PrefetchReads();
+#endif
 
 protected:
+#if CONFIG_DWSS_CONN_RAW_API
+	void Accept(Listener *listener, struct tcp_pcb *pcb, uint8_t protocol);
+#else
 	void Accept(Listener *listener, struct netconn *conn, uint8_t protocol);
+#endif
 
 	static uint16_t CountConnectionsOnPort(uint16_t port);
+	static size_t CountFreeSockets();
+	static void SetPcbOptions(struct tcp_pcb *pcb, const ConnOptionsData& options);
 
 private:
 	uint8_t number;
@@ -67,30 +117,161 @@ private:
 	uint16_t localPort;
 	uint16_t remotePort;
 	uint32_t remoteIp;
+#if CONFIG_DWSS_CONN_RAW_API
+	struct tcp_pcb *pcb;		// the pcb that corresponds to this connection. Once connected, only the tcpip task uses it.
+#else
 	struct netconn *conn;		// the pcb that corresponds to this connection
+#endif
 	Listener *listener;
-	volatile ConnState state;
+	ConnStateVar state;
 
 	uint32_t closeTimer;
 
 	struct pbuf *readBuf;		// the buffers holding data we have received that has not yet been taken
+	struct pbuf *readBufTail;	// the last buffer in the readBuf chain
+	size_t readBufLength;		// how much data in the readBuf chain has not yet been taken
 	size_t readIndex;			// how much data we have already read from the current pbuf
 	size_t alreadyRead;			// how much data we read from previous pbufs and didn't tell LWIP about yet
 	bool pendOtherEndClosed;	// indicates that the other end has closed the connection, but changing the state
 								// should wait after the data from this connection has all been read
 
+	uint8_t *rxRing;			// optional buffer that received data is copied into, so that its pbufs can be freed at once
+	size_t rxRingSize;			// the size of rxRing, zero if there is none. Only a connected socket has one.
+	size_t rxRingStart;			// where the oldest data in rxRing starts
+	size_t rxRingCount;			// how much data rxRing holds. This data precedes the data in readBuf.
+
+#if CONFIG_DWSS_READ_PREFETCH_BUFFERS
+	uint32_t *stage;			// prefetch buffer holding a copy of the oldest received data, if any
+	size_t stageLength;			// how much data the prefetch buffer holds
+	uint32_t lastRead;			// when the SAM last read from this connection, to choose which sockets to prefetch
+#endif
+
+	WriteOverflow *overflow;	// write data that lwIP could not accept yet, if any
+	bool closeAfterOverflow;	// close the connection when the overflow data has been sent
+
+	size_t sendBufferLimit;		// the most write data that may be waiting to be sent or acknowledged, 0 for no limit
+	size_t ackThreshold;		// how much data the SAM must read before we open the receive window, unless it reads everything
+
+	ConnStatsResponse stats;	// traffic statistics since this connection connected
+	uint32_t connectedAt;		// when this connection connected, for the time to the first data
+	uint8_t lastRetransmits;	// the pcb's retransmission count when we last looked at it
+
+	uint32_t lastActivity;		// when there was last traffic on this connection, or it last changed state
+	ConnState idleState;		// the state when lastActivity was last updated
+
+	volatile bool pollPending;	// set by the netconn callback when lwIP has something for us, cleared when we poll
+
+	// Outgoing connection setup. The DNS callback runs in the tcpip task, and identifies the lookup by the connection number and lookupId.
+	enum class Lookup : uint8_t { none, pending, found, failed };
+	std::atomic<Lookup> lookupState;
+	uint16_t lookupId;			// incremented for each lookup, so that the result of an earlier one is ignored
+	uint32_t connectTimer;		// when we started to connect
+	uint32_t connectTimeout;	// how long we may take to connect
+
+#if CONFIG_DWSS_CONN_RAW_API
+	// Queues between the tcpip task and the main task. Each index runs freely and is written by one task only.
+	struct pbuf *rxQueue[RawRxQueueLength];	// received pbuf chains
+	std::atomic<size_t> rxQueueIn;			// written by the tcpip task
+	std::atomic<size_t> rxQueueOut;			// written by the main task
+	std::atomic<size_t> rxConsumed;			// how much received data the SAM has taken, written by the main task
+	size_t rxAcked;							// how much of that we have passed to tcp_recved, only used by the tcpip task
+	uint8_t *txBuffer;						// write data waiting to be passed to tcp_write
+	std::atomic<size_t> txIn;				// written by the main task
+	std::atomic<size_t> txOut;				// written by the tcpip task
+	std::atomic<bool> remoteClosed;			// set by the tcpip task when the other end has closed its side
+	std::atomic<err_t> pcbError;			// set by the tcpip task when lwIP has freed the pcb because of an error
+#endif
+
+	ConnState reportedState;	// the state when events were last recorded
+	bool reportedReadable;		// whether there was data to read when events were last recorded
+	bool reportedWritable;		// whether there was write space when events were last recorded
+
 	void Poll();
+	void PollConnecting();
+	bool StartConnect();
+	void AppendPbuf(struct pbuf *data);
+	bool NeedsPoll() const;
+	uint32_t PollDelay(uint32_t now) const;
+	bool RecordEvents(size_t sharedSegments);
+	void CheckIdle(uint32_t now);
 	void SetState(ConnState st) { state = st; }
+	static void WakePollTask();
+	void DropStage();
+	bool TryAllocate();
+#if CONFIG_DWSS_CONN_RAW_API
+	void Connected(Listener *listener, struct tcp_pcb *pcb);
+#else
 	void Connected(Listener *listener, struct netconn *conn);
+#endif
 	ConnState GetState() const { return state; }
+	void ApplyOptions(const ConnOptionsData& options);
+	void ResetStats();
+	void SampleRetransmits(const struct tcp_pcb *pcb);
+	size_t LimitWriteSpace(size_t space, size_t waiting) const;
+
+	static Connection *connectionList[NumConnections];
+	static volatile size_t numSockets;			// the number of connections that the SAM is using
+	static size_t maxWriteLength;				// the most data that the SAM can send in one write
+
+	// Bitmaps of sockets with events that the SAM has not yet fetched
+	static uint32_t eventsConnected;
+	static uint32_t eventsReadable;
+	static bool eventsEnabled;					// set when the SAM first fetches the events
+	static uint32_t eventsWritable;
+	static uint32_t eventsClosed;
 
-	static SemaphoreHandle_t allocateMutex;
-	static Connection *connectionList[MaxConnections];
+	static uint16_t idleTimeouts[NumProtocols];	// seconds, 0 means never
+	static uint32_t reapedSockets;				// bitmap of sockets reaped since the SAM last fetched it
+
+	// Counters for the diagnostics report
+	static uint32_t timesReaped;
+	static uint32_t pollsDone;
+	static uint32_t pollsSkipped;
+	static TaskHandle_t pollTask;				// the task that calls PollAll, woken when lwIP or another task has something for it
+	static uint32_t pollNotifyBits;
+
+#if CONFIG_DWSS_READ_PREFETCH_BUFFERS
+	static uint32_t *freeStages[CONFIG_DWSS_READ_PREFETCH_BUFFERS];
+	static size_t numFreeStages;
+	static uint32_t stagedReads;				// reads answered from a prefetch buffer
+	static uint32_t stagesDropped;				// prefetch buffers discarded because the data was read some other way
+#endif
+
+#if CONFIG_DWSS_CONN_RAW_API
+	static std::atomic<bool> serviceQueued;		// whether the tcpip task has yet to run ServiceAll since we last asked it to
+	static uint32_t rxQueueFull;				// how many times we refused received data because a queue was full
+#endif
 
 	void FreePbuf();
+	void FreeFirstPbuf();
+	void DrainOverflow();
+	void ReleaseOverflow();
+	void AllocateRxRing();
+	void FreeRxRing();
+	void FillRxRing();
 	void Report();
 
+	static err_t DoLookup(struct tcpip_api_call_data *call);
+	static void LookupCallback(const char *name, const ip_addr_t *addr, void *arg);
+
+#if CONFIG_DWSS_CONN_RAW_API
+	void ResetQueues();
+	void ReleasePcb(bool abort);
+	void Service();
+
+	static void RequestService();
+	static void ServiceAll(void *);
+	static err_t DoConnect(struct tcpip_api_call_data *call);
+	static err_t DoClose(struct tcpip_api_call_data *call);
+	static err_t DoSetOptions(struct tcpip_api_call_data *call);
+	static err_t RecvCallback(void *arg, struct tcp_pcb *pcb, struct pbuf *p, err_t err);
+	static err_t SentCallback(void *arg, struct tcp_pcb *pcb, u16_t len);
+	static void ErrCallback(void *arg, err_t err);
+	static err_t ConnectedCallback(void *arg, struct tcp_pcb *pcb, err_t err);
+#else
 	static void ConnectCallback(struct netconn *conn, enum netconn_evt evt, u16_t len);
+	static void NetconnEvent(struct netconn *conn, enum netconn_evt evt);
+#endif
 
 };
 
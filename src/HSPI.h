@@ -29,6 +29,12 @@ const uint8_t SPI_MODE1 = 0x01; ///<  CPOL: 0  CPHA: 1
 const uint8_t SPI_MODE2 = 0x10; ///<  CPOL: 1  CPHA: 0
 const uint8_t SPI_MODE3 = 0x11; ///<  CPOL: 1  CPHA: 1
 
+// A piece of data to be sent as part of a longer transfer, which need not be dword aligned
+struct SpiChunk {
+  const uint8_t *data;
+  size_t length;
+};
+
 class HSPIClass {
 public:
   HSPIClass();
@@ -38,7 +44,11 @@ public:
   void beginTransaction();
   uint32_t transfer32(uint32_t data);
   void transferDwords(const uint32_t * out, uint32_t * in, uint32_t size);
+  void queueDwords(const uint32_t * out, uint32_t * in, uint32_t size);
+  void transferScatter(const SpiChunk *chunks, size_t numChunks);
+  void flush();
   void endTransaction(void);
+  void setFastPath(bool enable);
 
 private:
   void setClockDivider(uint32_t clockDiv);
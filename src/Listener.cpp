@@ -6,19 +6,26 @@
  */
 #include <cstring>
 #include <new>
+#include <algorithm>
+
+#include "rom/ets_sys.h"
 
 #include "lwip/tcp.h"
 
 #include "Listener.h"
 #include "Connection.h"
+#include "Misc.h"				// for millis
 #include "Config.h"
 
-static_assert(MaxConnections < sizeof(uint32_t) * 8); // Limits the listen callback value notification
-
+const uint32_t AcceptNotifyBit = 0x01;		// the listener task notification; acceptPending says which listeners it is for
 
 
-bool Listener::Start(uint16_t port, uint32_t ip, int protocol, int maxConns)
+bool Listener::Start(uint16_t port, uint32_t ip, int protocol, int maxConns, uint8_t priority, uint8_t reserved)
 {
+#if CONFIG_DWSS_CONN_RAW_API
+	ReapStopped();						// so that we don't mistake a finished FTP data listener for a live one
+#endif
+
 	// See if we are already listing for this
 	for (Listener *listener : listeners)
 	{
@@ -26,8 +33,10 @@ bool Listener::Start(uint16_t port, uint32_t ip, int protocol, int maxConns)
 		{
 			if (maxConns != 0 && (listener->ip == IPADDR_ANY || listener->ip == ip))
 			{
-				// already listening, so nothing to do
+				// already listening, so just take the new priority and reservation
 				debugPrintf("already listening on port %u\n", port);
+				listener->priority = priority;
+				listener->reservedConnections = reserved;
 				return true;
 			}
 			if (maxConns == 0 || ip == IPADDR_ANY)
@@ -43,9 +52,9 @@ bool Listener::Start(uint16_t port, uint32_t ip, int protocol, int maxConns)
 		return true;
 	}
 
-	uint8_t freeListener = MaxConnections + 1;
+	size_t freeListener = NumConnections;
 
-	for (int i = 0; i < MaxConnections; i++)
+	for (size_t i = 0; i < NumConnections; i++)
 	{
 		if (listeners[i] == nullptr)
 		{
@@ -54,12 +63,33 @@ bool Listener::Start(uint16_t port, uint32_t ip, int protocol, int maxConns)
 		}
 	}
 
-	if (freeListener < MaxConnections)
+	if (freeListener < NumConnections)
 	{
 		Listener *listener = new (std::nothrow) Listener;
 
 		if (listener)
 		{
+#if CONFIG_DWSS_CONN_RAW_API
+			// Prepare this before listening
+			listener->ip = ip;
+			listener->port = port;
+			listener->protocol = protocol;
+			listener->maxConnections = maxConns;
+			listener->priority = priority;
+			listener->reservedConnections = reserved;
+			listener->acceptTokens.Fill(millis(), ListenerAcceptBurst);
+			listener->pcb = nullptr;
+			listener->stopped = false;
+			listeners[freeListener] = listener;
+
+			const err_t rc = listener->Listen();
+			if (rc == ERR_OK)
+			{
+				return true;
+			}
+			listeners[freeListener] = nullptr;
+			debugPrintfAlways("Listen failed: %d\n", (int)rc);
+#else
 			// Setup LWIP listening connection.
 			struct netconn * conn = netconn_new_with_callback(NETCONN_TCP, Listener::ListenCallback);
 
@@ -83,6 +113,10 @@ bool Listener::Start(uint16_t port, uint32_t ip, int protocol, int maxConns)
 					listener->port = port;
 					listener->protocol = protocol;
 					listener->maxConnections = maxConns;
+					listener->priority = priority;
+					listener->reservedConnections = reserved;
+					listener->acceptTokens.Fill(millis(), ListenerAcceptBurst);
+					listener->acceptPending = false;
 					listener->conn = conn;
 					listeners[freeListener] = listener;
 
@@ -109,6 +143,7 @@ bool Listener::Start(uint16_t port, uint32_t ip, int protocol, int maxConns)
 			{
 				debugPrintAlways("can't allocate PCB\n");
 			}
+#endif
 
 			delete listener;
 		}
@@ -125,12 +160,14 @@ bool Listener::Start(uint16_t port, uint32_t ip, int protocol, int maxConns)
 	return false;
 }
 
+#if !CONFIG_DWSS_CONN_RAW_API		// the raw API versions are in RawTcp.cpp
+
 void Listener::Stop()
 {
 	netconn_close(conn);
 	netconn_delete(conn);
 
-	for (int i = 0; i < MaxConnections; i++)
+	for (size_t i = 0; i < NumConnections; i++)
 	{
 		Listener *listener = listeners[i];
 		if (listener && listener->conn == conn)
@@ -141,13 +178,17 @@ void Listener::Stop()
 	}
 }
 
+#endif
+
 /*static*/ void Listener::Init()
 {
-	for (int i  = 0; i < MaxConnections; i++)
+	for (size_t i = 0; i < NumConnections; i++)
 	{
 		listeners[i] = nullptr;
 	}
-	xTaskCreate(ListenerTask, "tcpListener", TCP_LISTENER_STACK, NULL, TCP_LISTENER_PRIO, &listenTaskHandle);
+#if !CONFIG_DWSS_CONN_RAW_API
+	CreateNetworkTask(ListenerTask, "tcpListener", TCP_LISTENER_STACK, NULL, TCP_LISTENER_PRIO, &listenTaskHandle);
+#endif
 }
 
 /*static*/ void Listener::Stop(uint16_t port)
@@ -161,6 +202,88 @@ void Listener::Stop()
 	}
 }
 
+// Return true if this listener may have a free socket for a new connection. It must have fewer connections than it is allowed,
+// and taking the socket must leave enough free for the other listeners to have the ones they reserve.
+bool Listener::CanAccept() const
+{
+	if (Connection::CountConnectionsOnPort(port) >= maxConnections)
+	{
+		return false;
+	}
+
+	size_t needed = 1;
+	for (const Listener *listener : listeners)
+	{
+		if (listener && listener != this && listener->reservedConnections != 0)
+		{
+			const uint16_t numConns = Connection::CountConnectionsOnPort(listener->port);
+			if (numConns < listener->reservedConnections)
+			{
+				needed += listener->reservedConnections - numConns;
+			}
+		}
+	}
+	return Connection::CountFreeSockets() >= needed;
+}
+
+bool TokenBucket::Take(uint32_t now, uint32_t burst, uint32_t ratePerSecond)
+{
+	const uint32_t full = burst * 1000;
+	const uint32_t elapsed = now - lastRefill;
+	lastRefill = now;
+	tokens = (elapsed >= full) ? full : std::min<uint32_t>(full, tokens + elapsed * ratePerSecond);	// a token a second is a thousandth a millisecond
+	if (tokens < 1000)
+	{
+		return false;
+	}
+	tokens -= 1000;
+	return true;
+}
+
+// Decide whether to accept a connection from remoteIp, taking a token from the remote address first and then from the listener.
+// Only one task calls this: the listener task with netconns, or the tcpip task with the raw API.
+bool Listener::RateAllowed(uint32_t remoteIp)
+{
+	const uint32_t now = millis();
+
+	// Find the remote address, or else reuse the bucket that has been left alone longest
+	RemoteIpBucket *bucket = &remoteIpBuckets[0];
+	for (RemoteIpBucket& b : remoteIpBuckets)
+	{
+		if (b.ip == remoteIp)
+		{
+			bucket = &b;
+			break;
+		}
+		if (now - b.tokens.lastRefill > now - bucket->tokens.lastRefill)
+		{
+			bucket = &b;
+		}
+	}
+	if (bucket->ip != remoteIp)
+	{
+		bucket->ip = remoteIp;
+		bucket->tokens.Fill(now, RemoteIpAcceptBurst);
+	}
+
+	if (!bucket->tokens.Take(now, RemoteIpAcceptBurst, RemoteIpAcceptRate))
+	{
+		++droppedByRemoteIpRate;
+		return false;
+	}
+	if (!acceptTokens.Take(now, ListenerAcceptBurst, ListenerAcceptRate))
+	{
+		++droppedByListenerRate;
+		return false;
+	}
+	return true;
+}
+
+/*static*/ void Listener::Report()
+{
+	ets_printf("Accepts dropped by rate limit: listener %u, remote address %u\n", droppedByListenerRate, droppedByRemoteIpRate);
+}
+
 /*static*/ uint16_t Listener::GetPortByProtocol(uint8_t protocol)
 {
 	for (Listener *listener : listeners)
@@ -173,91 +296,145 @@ void Listener::Stop()
 	return 0;
 }
 
+#if !CONFIG_DWSS_CONN_RAW_API
+
 /*static*/ void Listener::ListenCallback(struct netconn *conn, enum netconn_evt evt, u16_t len)
 {
 	// debugPrintfAlways("netconn: %p, evt: %d len: %d\n", conn, evt, len);
-	if (conn && conn->pcb.tcp && !len)
+	for (size_t i = 0; i < NumConnections; i++)
 	{
-		if (evt == NETCONN_EVT_RCVPLUS) // len == 0 && NETCONN_EVT_RCVPLUS can only be called for new connection
+		Listener *listener = listeners[i];
+		if (listener && listener->conn == conn)
 		{
-			for (int i = 0; i < MaxConnections; i++)
+			if (conn->pcb.tcp && !len && evt == NETCONN_EVT_RCVPLUS) // len == 0 && NETCONN_EVT_RCVPLUS can only be called for new connection
 			{
-				Listener *listener = listeners[i];
-				if (listener && listener->conn == conn)
-				{
-					xTaskNotify(listenTaskHandle, 0b1 << i, eSetBits);
-				}
+				listener->acceptPending = true;
+				xTaskNotify(listenTaskHandle, AcceptNotifyBit, eSetBits);
 			}
+			return;
 		}
 	}
+
+	// Connections accepted from a listener inherit its callback, so this event is for one of those
+	if (conn)
+	{
+		Connection::NetconnEvent(conn, evt);
+	}
 }
 
-void Listener::Notify()
+// This is called when a connection is freed. Whichever listener it came from, that may let a waiting connection on any listener have a socket.
+/*static*/ void Listener::Notify()
 {
-	for (int i = 0; i < MaxConnections; i++)
+	for (const Listener *listener : listeners)
 	{
-		Listener *listener = listeners[i];
-		if (this == listener)
+		if (listener && listener->acceptPending)
 		{
-			xTaskNotify(listenTaskHandle, 0b1 << i, eSetBits);
+			xTaskNotify(listenTaskHandle, AcceptNotifyBit, eSetBits);
 			break;
 		}
 	}
 }
 
+// Accept the waiting connections while we may have sockets for them. Several connections may arrive for one wake-up, so carry on
+// until the backlog is empty, and only then leave acceptPending clear. If we run out of sockets first, acceptPending stays set,
+// so that we try again when Notify says that a socket has been freed.
+void Listener::TryAccept()
+{
+	for (;;)
+	{
+		if (!CanAccept())
+		{
+			debugPrintfAlways("pend connection on port %u\n", port);
+			return;
+		}
+
+		Connection * const c = Connection::Allocate();
+		if (c == nullptr)
+		{
+			debugPrintfAlways("pend connection on port %u no free conn\n", port);
+			return;
+		}
+
+		acceptPending = false;		// clear before accepting, so that a new callback is not lost
+		struct netconn *newConn;
+		err_t rc = netconn_accept(conn, &newConn);
+		if (rc == ERR_WOULDBLOCK)
+		{
+			c->Deallocate();		// the backlog is empty
+			return;
+		}
+
+		if (rc == ERR_OK && (newConn->pcb.tcp == nullptr || !RateAllowed(newConn->pcb.tcp->remote_ip.u_addr.ip4.addr)))
+		{
+			// lwIP has already completed the handshake, so we can only close it
+			netconn_close(newConn);
+			netconn_delete(newConn);
+			rc = ERR_ABRT;
+		}
+
+		if (rc == ERR_OK)
+		{
+			netconn_set_nonblocking(newConn, true);
+			netconn_set_recvtimeout(newConn, MaxReadWriteTime);
+			netconn_set_sendtimeout(newConn, MaxReadWriteTime);
+			c->Accept(this, newConn, protocol);
+			if (protocol == protocolFtpData)
+			{
+				debugPrintf("accept conn, stop listen on port %u\n", port);
+				Stop();		// don't listen for further connections. This deletes us.
+				return;
+			}
+		}
+		else
+		{
+			c->Deallocate();
+			if (rc != ERR_ABRT)
+			{
+				return;				// the listener itself has failed, so don't keep trying
+			}
+		}
+		acceptPending = true;		// there may be more connections behind this one
+	}
+}
+
 /*static*/ void Listener::ListenerTask(void* p)
 {
 	uint32_t flags = 0;
 
 	while (xTaskNotifyWait(0, UINT_MAX, &flags, portMAX_DELAY) == pdTRUE) // should always be true
 	{
-		for (int i = 0; i < MaxConnections; i++)
+		// Serve the waiting listeners in priority order, so that when sockets are scarce the more important ones get them.
+		// Look each one up again because accepting an FTP data connection deletes its listener.
+		uint32_t tried = 0;
+		for (;;)
 		{
-			Listener *listener = listeners[i];
-
-			if (listener && (flags & (0b1 << i)))
+			size_t next = NumConnections;
+			for (size_t i = 0; i < NumConnections; i++)
 			{
-				const uint16_t numConns = Connection::CountConnectionsOnPort(listener->port);
-				if (numConns < listener->maxConnections)
+				const Listener *listener = listeners[i];
+				if (listener && listener->acceptPending && (tried & (1u << i)) == 0
+					&& (next == NumConnections || listener->priority > listeners[next]->priority))
 				{
-					Connection * const c = Connection::Allocate();
-					if (c != nullptr)
-					{
-						struct netconn *newConn;
-						err_t rc = netconn_accept(listener->conn, &newConn);
-						if (rc == ERR_OK)
-						{
-							netconn_set_nonblocking(newConn, true);
-							netconn_set_recvtimeout(newConn, MaxReadWriteTime);
-							netconn_set_sendtimeout(newConn, MaxReadWriteTime);
-							c->Accept(listener, newConn, listener->protocol);
-							if (listener->protocol == protocolFtpData)
-							{
-								debugPrintf("accept conn, stop listen on port %u\n", listener->port);
-								listener->Stop();	// don't listen for further connections
-							}
-						}
-						else
-						{
-							c->Deallocate();
-						}
-					}
-					else
-					{
-						debugPrintfAlways("pend connection on port %u no free conn\n", listener->port);
-					}
-				}
-				else
-				{
-					debugPrintfAlways("pend connection on port %u already %u conns\n", listener->port, numConns);
+					next = i;
 				}
 			}
+			if (next == NumConnections)
+			{
+				break;
+			}
+			tried |= 1u << next;
+			listeners[next]->TryAccept();
 		}
 	}
 }
 
+#endif
+
 // Static member data
 TaskHandle_t Listener::listenTaskHandle = nullptr;
-Listener *Listener::listeners[MaxConnections];
+Listener *Listener::listeners[NumConnections];
+Listener::RemoteIpBucket Listener::remoteIpBuckets[NumRemoteIpBuckets];
+uint32_t Listener::droppedByListenerRate = 0;
+uint32_t Listener::droppedByRemoteIpRate = 0;
 
 // End
@@ -12,35 +12,89 @@
 #include <cstddef>
 
 #include "include/MessageFormats.h"
+#include "Config.h"
 #include "lwip/api.h"
 
+struct tcpip_api_call_data;
+
+// Token bucket for rate limiting. Tokens are counted in thousandths so that they can be added every millisecond.
+struct TokenBucket
+{
+	uint32_t tokens;
+	uint32_t lastRefill;
+
+	void Fill(uint32_t now, uint32_t burst) { tokens = burst * 1000; lastRefill = now; }
+	bool Take(uint32_t now, uint32_t burst, uint32_t ratePerSecond);
+};
+
 class Listener
 {
 public:
-	void Notify();
-
+	static void Notify();
+	static void Report();
 	static void Init();
-	static bool Start(uint16_t port, uint32_t ip, int protocol, int maxConns);
+	static bool Start(uint16_t port, uint32_t ip, int protocol, int maxConns, uint8_t priority, uint8_t reserved);
 	static void Stop(uint16_t port);
+#if CONFIG_DWSS_CONN_RAW_API
+	static void ReapStopped();
+#endif
 
 	static uint16_t GetPortByProtocol(uint8_t protocol);
 	static uint8_t Find(uint8_t port);
 
 private:
+#if CONFIG_DWSS_CONN_RAW_API
+	struct tcp_pcb *pcb;
+#else
 	struct netconn *conn;
+#endif
 
 	uint32_t ip;
 	uint16_t port;
 	uint16_t maxConnections;
 	uint8_t protocol;
+	uint8_t priority;					// waiting connections on higher priority listeners get free sockets first
+	uint8_t reservedConnections;		// how many sockets other listeners must leave for this one
+	TokenBucket acceptTokens;
+#if CONFIG_DWSS_CONN_RAW_API
+	volatile bool stopped;				// set by the tcpip task when an FTP data listener has had its connection, so that the main task deletes it
+#else
+	volatile bool acceptPending;		// set when there may be a connection waiting to be accepted
+#endif
 
 	void Stop();
+	bool CanAccept() const;
+	bool RateAllowed(uint32_t remoteIp);
 
 	static TaskHandle_t listenTaskHandle;
-	static Listener *listeners[MaxConnections];
+	static Listener *listeners[NumConnections];
+
+	// Rate limits for the most recent remote addresses, shared by all listeners
+	struct RemoteIpBucket
+	{
+		uint32_t ip;
+		TokenBucket tokens;
+	};
+	static RemoteIpBucket remoteIpBuckets[NumRemoteIpBuckets];
+
+	// Counters for the diagnostics report
+	static uint32_t droppedByListenerRate;
+	static uint32_t droppedByRemoteIpRate;
+
+#if CONFIG_DWSS_CONN_RAW_API
+	err_t Listen();
+	void Unlisten();
+
+	static err_t DoListen(struct tcpip_api_call_data *call);
+	static err_t DoStop(struct tcpip_api_call_data *call);
+	static void ClosePcbCallback(void *arg);
+	static err_t AcceptCallback(void *arg, struct tcp_pcb *newPcb, err_t err);
+#else
+	void TryAccept();
 
 	static void ListenerTask(void* data);
 	static void ListenCallback(struct netconn *conn, enum netconn_evt evt, u16_t len);
+#endif
 };
 
 #endif /* SRC_LISTENER_H_ */
@@ -0,0 +1,634 @@
+/*
+ * RawTcp.cpp
+ *
+ * Connection and Listener functions for the lwIP raw API backend, selected by DWSS_CONN_RAW_API.
+ * The lwIP callbacks run in the tcpip task. Received data is passed to the main task through a queue in each connection,
+ * and write data goes the other way through a buffer in each connection, so reading and writing don't wait for the tcpip task.
+ * Opening and closing connections and listeners is rare, so that is still done with blocking calls into the tcpip task.
+ */
+#include <cstring>
+#include <algorithm>
+
+#include "Config.h"
+
+#if CONFIG_DWSS_CONN_RAW_API
+
+#include "lwip/tcp.h"
+#include "lwip/tcpip.h"
+#include "lwip/priv/tcpip_priv.h"
+
+#include "Connection.h"
+#include "Listener.h"
+#include "Misc.h"				// for millis
+
+// Arguments of the blocking calls into the tcpip task. The call data must come first.
+struct ConnectionCall
+{
+	struct tcpip_api_call_data call;
+	Connection *conn;
+	uint32_t remoteIp;
+	uint16_t remotePort;
+	bool abort;
+};
+
+struct OptionsCall
+{
+	struct tcpip_api_call_data call;
+	Connection *conn;
+	const ConnOptionsData *options;
+};
+
+struct ListenerCall
+{
+	struct tcpip_api_call_data call;
+	Listener *listener;
+};
+
+// Functions called by the main task
+
+size_t Connection::Write(const uint8_t *data, size_t length, bool doPush, bool closeAfterSending)
+{
+	if (!(state == ConnState::connected && !pendOtherEndClosed) || txBuffer == nullptr)
+	{
+		return 0;
+	}
+
+	// The SAM only sends as much as CanWrite allowed, but never overwrite data that the tcpip task hasn't taken yet.
+	// The tcpip task pushes whatever it passes to lwIP, so doPush has no effect.
+	const size_t in = txIn.load(std::memory_order_relaxed);
+	const size_t written = std::min<size_t>(length, RawTxBufferSize - (in - txOut.load(std::memory_order_acquire)));
+	const size_t start = in % RawTxBufferSize;
+	const size_t firstPart = std::min<size_t>(written, RawTxBufferSize - start);
+	memcpy(txBuffer + start, data, firstPart);
+	memcpy(txBuffer, data + firstPart, written - firstPart);
+	txIn.store(in + written, std::memory_order_release);
+	RequestService();
+	lastActivity = millis();
+	stats.bytesOut += written;
+
+	if (written != length)
+	{
+		debugPrintfAlways("Write overrun len=%u space=%u\n", length, written);
+		++stats.writeFailures;
+	}
+
+	if (CanWrite() == 0)
+	{
+		reportedWritable = false;			// so that space becoming available before the next poll is reported
+	}
+
+	// Close the connection again when we're done
+	if (closeAfterSending)
+	{
+		Close();							// deferred until the tcpip task has taken the data
+	}
+
+	return written;
+}
+
+// The write buffer already limits each connection, so the raw backend doesn't share out the heap
+/*static*/ size_t Connection::SharedWriteSegments()
+{
+	return 0;
+}
+
+// Return the free space in the write buffer. Once the data is in the buffer it is safe, even if lwIP can't take it yet,
+// so unlike the netconn backend we don't need to allow for lwIP failing to allocate memory.
+size_t Connection::CanWrite(size_t sharedSegments) const
+{
+	(void)sharedSegments;
+	if (!(state == ConnState::connected && !pendOtherEndClosed) || txBuffer == nullptr)
+	{
+		return 0;
+	}
+
+	const size_t waiting = txIn.load(std::memory_order_relaxed) - txOut.load(std::memory_order_acquire);
+	return LimitWriteSpace(std::min<size_t>(RawTxBufferSize - waiting, maxWriteLength), waiting);
+}
+
+void Connection::Poll()
+{
+	if (state == ConnState::connecting)
+	{
+		PollConnecting();
+		return;
+	}
+
+	if ((state == ConnState::connected && !pendOtherEndClosed) || state == ConnState::otherEndClosed)
+	{
+		// Look for a close or error before taking the queued data, so that we also take any data that arrived just before it
+		const bool closed = remoteClosed.load(std::memory_order_acquire);
+		const err_t err = pcbError.load(std::memory_order_acquire);
+
+		const size_t in = rxQueueIn.load(std::memory_order_acquire);
+		for (size_t out = rxQueueOut.load(std::memory_order_relaxed); out != in; ++out)
+		{
+			AppendPbuf(rxQueue[out % RawRxQueueLength]);
+		}
+		rxQueueOut.store(in, std::memory_order_release);
+		FillRxRing();
+
+		if (txOut.load(std::memory_order_relaxed) != txIn.load(std::memory_order_relaxed))
+		{
+			RequestService();				// lwIP didn't have room for all the write data last time
+		}
+
+		if (closed || err != ERR_OK)
+		{
+			if (closed || err == ERR_RST || err == ERR_CLSD || err == ERR_CONN)
+			{
+				// As in the netconn backend, don't report that the other end has closed until the SAM has read all the data
+				if (CanRead() != 0)
+				{
+					pendOtherEndClosed = true;
+				}
+				else
+				{
+					SetState(ConnState::otherEndClosed);
+				}
+			}
+			else
+			{
+				Terminate(false);
+			}
+		}
+	}
+	else if (state == ConnState::closeReady)
+	{
+		Close();
+	}
+	else if (state == ConnState::closePending)
+	{
+		// We're about to close this connection and we're still waiting for the tcpip task to take the remaining data
+		if (txOut.load(std::memory_order_acquire) == txIn.load(std::memory_order_relaxed))
+		{
+			stats.closePendingMillis = millis() - closeTimer;
+			SetState(ConnState::closeReady);		// lwIP sends it before the FIN
+		}
+		else if (millis() - closeTimer >= MaxAckTime)
+		{
+			stats.closePendingMillis = millis() - closeTimer;
+			Terminate(false);
+		}
+		else
+		{
+			RequestService();
+		}
+	}
+	else { }
+}
+
+void Connection::Close()
+{
+	switch(state)
+	{
+	case ConnState::connected:						// both ends are still connected
+		if (txOut.load(std::memory_order_acquire) != txIn.load(std::memory_order_relaxed))
+		{
+			closeTimer = millis();
+			SetState(ConnState::closePending);		// wait for the tcpip task to take the remaining data before closing
+			RequestService();
+			break;
+		}
+		// fallthrough
+	case ConnState::otherEndClosed:					// the other end has already closed the connection
+	case ConnState::closeReady:						// the other end has closed and we were already closePending
+	default:										// should not happen
+		{
+			ConnectionCall cc;
+			cc.conn = this;
+			cc.abort = false;
+			tcpip_api_call(DoClose, &cc.call);
+		}
+		FreePbuf();
+		SetState(ConnState::free);
+		break;
+
+	case ConnState::closePending:					// we already asked to close
+		break;
+	}
+}
+
+// Start to connect to remoteIp and remotePort
+bool Connection::StartConnect()
+{
+	ResetQueues();
+	SetState(ConnState::connecting);
+
+	ConnectionCall cc;
+	cc.conn = this;
+	cc.remoteIp = remoteIp;
+	cc.remotePort = remotePort;
+	const err_t rc = tcpip_api_call(DoConnect, &cc.call);
+	if (rc != ERR_OK)
+	{
+		debugPrintfAlways("can't connect: %d\n", (int)rc);
+		Terminate(false);
+		return false;
+	}
+
+	return true;
+}
+
+void Connection::Terminate(bool external)
+{
+	ConnectionCall cc;
+	cc.conn = this;
+	cc.abort = true;
+	tcpip_api_call(DoClose, &cc.call);
+
+	FreePbuf();
+	SetState((external) ? ConnState::free : ConnState::aborted);
+}
+
+void Connection::ApplyOptions(const ConnOptionsData& options)
+{
+	OptionsCall oc;
+	oc.conn = this;
+	oc.options = &options;
+	tcpip_api_call(DoSetOptions, &oc.call);
+}
+
+void Connection::ResetQueues()
+{
+	rxQueueIn.store(0, std::memory_order_relaxed);
+	rxQueueOut.store(0, std::memory_order_relaxed);
+	rxConsumed.store(0, std::memory_order_relaxed);
+	rxAcked = 0;
+	txIn.store(0, std::memory_order_relaxed);
+	txOut.store(0, std::memory_order_relaxed);
+	remoteClosed.store(false, std::memory_order_relaxed);
+	pcbError.store(ERR_OK, std::memory_order_relaxed);
+}
+
+// Ask the tcpip task to pass write data and receive window updates to lwIP, unless it has yet to do so since we last asked
+/*static*/ void Connection::RequestService()
+{
+	std::atomic_thread_fence(std::memory_order_seq_cst);		// pairs with the fence in ServiceAll
+	if (!serviceQueued.load(std::memory_order_relaxed))
+	{
+		serviceQueued.store(true, std::memory_order_relaxed);
+		if (tcpip_try_callback(ServiceAll, nullptr) != ERR_OK)
+		{
+			serviceQueued.store(false, std::memory_order_relaxed);	// the tcpip mailbox is full, so try again next time
+		}
+	}
+}
+
+// Functions called in the tcpip task
+
+/*static*/ void Connection::ServiceAll(void *)
+{
+	serviceQueued.store(false, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_seq_cst);		// so that we see anything the main task did before it saw the flag set
+	for (Connection *c : connectionList)
+	{
+		c->Service();
+	}
+}
+
+void Connection::Service()
+{
+	if (pcb == nullptr)
+	{
+		return;
+	}
+
+	// Open the receive window by as much as the SAM has taken
+	const size_t consumed = rxConsumed.load(std::memory_order_acquire);
+	while (rxAcked != consumed)
+	{
+		const u16_t len = std::min<size_t>(consumed - rxAcked, UINT16_MAX);
+		tcp_recved(pcb, len);
+		rxAcked += len;
+	}
+
+	// Pass as much write data to lwIP as it will take. Any that is left is passed on when some data has been acknowledged.
+	const size_t in = txIn.load(std::memory_order_acquire);
+	size_t out = txOut.load(std::memory_order_relaxed);
+	while (out != in)
+	{
+		const size_t start = out % RawTxBufferSize;
+		const u16_t len = std::min<size_t>(std::min<size_t>(in - out, RawTxBufferSize - start), tcp_sndbuf(pcb));
+		if (len == 0 || tcp_write(pcb, txBuffer + start, len, TCP_WRITE_FLAG_COPY | ((out + len != in) ? TCP_WRITE_FLAG_MORE : 0)) != ERR_OK)
+		{
+			break;
+		}
+		out += len;
+	}
+
+	if (out != txOut.load(std::memory_order_relaxed))
+	{
+		txOut.store(out, std::memory_order_release);
+		tcp_output(pcb);
+	}
+	else if (out != in)
+	{
+		++stats.overflows;							// lwIP couldn't take any of the waiting data
+	}
+
+	SampleRetransmits(pcb);
+}
+
+// Detach the pcb from this connection and close or abort it
+void Connection::ReleasePcb(bool abort)
+{
+	if (pcb != nullptr)
+	{
+		tcp_arg(pcb, nullptr);
+		tcp_recv(pcb, nullptr);
+		tcp_sent(pcb, nullptr);
+		tcp_err(pcb, nullptr);
+		if (abort || tcp_close(pcb) != ERR_OK)		// tcp_close only fails if there is no memory to send the FIN
+		{
+			tcp_abort(pcb);
+		}
+		pcb = nullptr;
+	}
+}
+
+void Connection::Accept(Listener *listener, struct tcp_pcb *pcb, uint8_t protocol)
+{
+	this->protocol = protocol;
+	ResetQueues();
+	Connected(listener, pcb);
+}
+
+void Connection::Connected(Listener *listener, struct tcp_pcb *pcb)
+{
+	this->pcb = pcb;
+	this->listener = listener;
+	localPort = pcb->local_port;
+	remotePort = pcb->remote_port;
+	remoteIp = pcb->remote_ip.u_addr.ip4.addr;
+	readIndex = alreadyRead = closeTimer = pendOtherEndClosed = 0;
+	sendBufferLimit = 0;
+	ackThreshold = TCP_MSS;
+	ResetStats();
+	AllocateRxRing();
+
+	tcp_arg(pcb, this);
+	tcp_recv(pcb, RecvCallback);
+	tcp_sent(pcb, SentCallback);
+	tcp_err(pcb, ErrCallback);
+
+	// Mark the connection ready last, so the main task does not use it when it's not ready
+	pollPending = true;
+	SetState(ConnState::connected);
+	WakePollTask();
+}
+
+/*static*/ err_t Connection::DoConnect(struct tcpip_api_call_data *call)
+{
+	ConnectionCall * const cc = reinterpret_cast<ConnectionCall *>(call);
+	struct tcp_pcb * const pcb = tcp_new();
+	if (pcb == nullptr)
+	{
+		return ERR_MEM;
+	}
+
+	ip_set_option(pcb, SOF_REUSEADDR);
+	tcp_arg(pcb, cc->conn);
+	tcp_err(pcb, ErrCallback);
+
+	ip_addr_t tempIp;
+	memset(&tempIp, 0, sizeof(tempIp));
+	tempIp.u_addr.ip4.addr = cc->remoteIp;
+	const err_t rc = tcp_connect(pcb, &tempIp, cc->remotePort, ConnectedCallback);
+	if (rc != ERR_OK)
+	{
+		tcp_arg(pcb, nullptr);
+		tcp_err(pcb, nullptr);
+		tcp_abort(pcb);
+		return rc;
+	}
+
+	cc->conn->pcb = pcb;
+	return ERR_OK;
+}
+
+/*static*/ err_t Connection::DoSetOptions(struct tcpip_api_call_data *call)
+{
+	OptionsCall * const oc = reinterpret_cast<OptionsCall *>(call);
+	if (oc->conn->pcb != nullptr)
+	{
+		SetPcbOptions(oc->conn->pcb, *oc->options);
+	}
+	return ERR_OK;
+}
+
+/*static*/ err_t Connection::DoClose(struct tcpip_api_call_data *call)
+{
+	ConnectionCall * const cc = reinterpret_cast<ConnectionCall *>(call);
+	cc->conn->ReleasePcb(cc->abort);
+	return ERR_OK;
+}
+
+/*static*/ err_t Connection::ConnectedCallback(void *arg, struct tcp_pcb *pcb, err_t err)
+{
+	Connection * const c = static_cast<Connection *>(arg);
+	if (c != nullptr && c->state == ConnState::connecting)
+	{
+		c->Connected(nullptr, pcb);
+	}
+	return ERR_OK;
+}
+
+/*static*/ err_t Connection::RecvCallback(void *arg, struct tcp_pcb *pcb, struct pbuf *p, err_t err)
+{
+	Connection * const c = static_cast<Connection *>(arg);
+	if (p == nullptr)
+	{
+		c->remoteClosed.store(true, std::memory_order_release);
+	}
+	else
+	{
+		const size_t in = c->rxQueueIn.load(std::memory_order_relaxed);
+		if (in - c->rxQueueOut.load(std::memory_order_acquire) == RawRxQueueLength)
+		{
+			++rxQueueFull;
+			return ERR_MEM;							// lwIP holds on to the data and offers it to us again later
+		}
+		c->rxQueue[in % RawRxQueueLength] = p;
+		c->rxQueueIn.store(in + 1, std::memory_order_release);
+	}
+	c->pollPending = true;
+	WakePollTask();
+	return ERR_OK;
+}
+
+/*static*/ err_t Connection::SentCallback(void *arg, struct tcp_pcb *pcb, u16_t len)
+{
+	Connection * const c = static_cast<Connection *>(arg);
+	c->Service();									// there may be room for more write data now
+	WakePollTask();									// so that the SAM hears about it
+	return ERR_OK;
+}
+
+// lwIP has already freed the pcb when it calls this
+/*static*/ void Connection::ErrCallback(void *arg, err_t err)
+{
+	Connection * const c = static_cast<Connection *>(arg);
+	if (c != nullptr)
+	{
+		c->pcb = nullptr;
+		if (c->state == ConnState::connecting)
+		{
+			c->SetState(ConnState::otherEndClosed);
+		}
+		else
+		{
+			c->pcbError.store(err, std::memory_order_release);
+			c->pollPending = true;
+		}
+		WakePollTask();
+	}
+}
+
+// Listener functions called by the main task
+
+err_t Listener::Listen()
+{
+	ListenerCall lc;
+	lc.listener = this;
+	return tcpip_api_call(DoListen, &lc.call);
+}
+
+void Listener::Stop()
+{
+	ListenerCall lc;
+	lc.listener = this;
+	tcpip_api_call(DoStop, &lc.call);
+	delete this;
+}
+
+// Delete the FTP data listeners that have had their connection
+/*static*/ void Listener::ReapStopped()
+{
+	for (Listener *listener : listeners)
+	{
+		if (listener != nullptr && listener->stopped)
+		{
+			listener->Stop();
+		}
+	}
+}
+
+// Connections are refused rather than left waiting when there is none free, so there is nothing to do when one is freed
+/*static*/ void Listener::Notify()
+{
+}
+
+// Listener functions called in the tcpip task
+
+/*static*/ err_t Listener::DoListen(struct tcpip_api_call_data *call)
+{
+	Listener * const listener = reinterpret_cast<ListenerCall *>(call)->listener;
+	struct tcp_pcb * const pcb = tcp_new();
+	if (pcb == nullptr)
+	{
+		return ERR_MEM;
+	}
+
+	ip_addr_t tempIp;
+	memset(&tempIp, 0, sizeof(tempIp));
+	tempIp.u_addr.ip4.addr = listener->ip;
+	ip_set_option(pcb, SOF_REUSEADDR); // seems to be needed for avoiding ERR_USE error when switching from client to AP
+
+	err_t rc = tcp_bind(pcb, &tempIp, listener->port);
+	if (rc == ERR_OK)
+	{
+		struct tcp_pcb * const listenPcb = tcp_listen_with_backlog(pcb, Backlog);		// this frees pcb if it succeeds
+		if (listenPcb != nullptr)
+		{
+			listener->pcb = listenPcb;
+			tcp_arg(listenPcb, listener);
+			tcp_accept(listenPcb, AcceptCallback);
+			return ERR_OK;
+		}
+		rc = ERR_MEM;
+	}
+
+	tcp_close(pcb);
+	return rc;
+}
+
+/*static*/ err_t Listener::DoStop(struct tcpip_api_call_data *call)
+{
+	reinterpret_cast<ListenerCall *>(call)->listener->Unlisten();
+	return ERR_OK;
+}
+
+// Close the listening pcb and remove this from the list of listeners
+void Listener::Unlisten()
+{
+	if (pcb != nullptr)
+	{
+		tcp_arg(pcb, nullptr);
+		tcp_accept(pcb, nullptr);
+		tcp_close(pcb);
+		pcb = nullptr;
+	}
+
+	for (Listener *&listener : listeners)
+	{
+		if (listener == this)
+		{
+			listener = nullptr;
+		}
+	}
+}
+
+/*static*/ void Listener::ClosePcbCallback(void *arg)
+{
+	tcp_close(static_cast<struct tcp_pcb *>(arg));
+}
+
+/*static*/ err_t Listener::AcceptCallback(void *arg, struct tcp_pcb *newPcb, err_t err)
+{
+	Listener * const listener = static_cast<Listener *>(arg);
+	if (listener == nullptr || newPcb == nullptr || err != ERR_OK)
+	{
+		return ERR_VAL;
+	}
+
+	if (!listener->RateAllowed(newPcb->remote_ip.u_addr.ip4.addr))
+	{
+		tcp_abort(newPcb);
+		return ERR_ABRT;
+	}
+
+	Connection * const c = (listener->CanAccept()) ? Connection::Allocate() : nullptr;
+	if (c == nullptr)
+	{
+		debugPrintfAlways("refuse connection on port %u\n", listener->port);
+		tcp_abort(newPcb);
+		return ERR_ABRT;
+	}
+
+	if (listener->protocol == protocolFtpData)
+	{
+		// Don't listen for further connections. Detach the listening pcb now, but closing it from inside its own callback isn't safe,
+		// so do that later. The main task deletes the listener, because it may be using it,
+		// and accepting the connection wakes it.
+		debugPrintf("accept conn, stop listen on port %u\n", listener->port);
+		listener->maxConnections = 0;
+		tcp_arg(listener->pcb, nullptr);
+		tcp_accept(listener->pcb, nullptr);
+		if (tcpip_try_callback(ClosePcbCallback, listener->pcb) == ERR_OK)
+		{
+			listener->pcb = nullptr;
+		}
+		else
+		{
+			debugPrintAlways("can't stop listening\n");		// Unlisten closes it when the main task stops the listener
+		}
+		listener->stopped = true;
+	}
+	c->Accept(listener, newPcb, listener->protocol);
+	return ERR_OK;
+}
+
+#endif
+
+// End
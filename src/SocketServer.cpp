@@ -23,6 +23,7 @@ extern "C"
 #include "freertos/FreeRTOS.h"
 #include "freertos/event_groups.h"
 #include "freertos/task.h"
+#include "freertos/queue.h"
 #include "esp_netif.h"
 #include "esp_wifi.h"
 #include "esp_system.h"
@@ -64,6 +65,7 @@ extern esp_rom_spiflash_chip_t g_rom_flashchip;
 #else
 #include "esp32/spi.h"
 #include "esp_flash.h"
+#include "esp_cpu.h"
 #endif
 
 #include "esp_wpa2.h"
@@ -73,10 +75,12 @@ static_assert(WIFI_CONNECTION_PRIO == MAIN_PRIO);
 
 static const uint32_t MaxConnectTime = 40 * 1000;			// how long we wait for WiFi to connect in milliseconds
 static const uint32_t TransferReadyTimeout = 10;			// how many milliseconds we allow for the Duet to set
-													// TransferReady low after the end of a transaction,
+													// TransferReady low and high again after the start of a transaction,
 													// before we assume that we missed seeing it
 #define array _ecv_array
 
+static const size_t LegacyConnStatusLength = offsetof(ConnStatusResponse, connectedSocketsWide);	// what SAM firmware older than 2.4 expects
+
 static const uint32_t StatusReportMillis = 200;
 static const int DefaultWiFiChannel = 6;
 
@@ -107,16 +111,31 @@ static DNSServer dns;
 
 static volatile const char* lastError = nullptr;
 static volatile const char* prevLastError = nullptr;
+static volatile const char* jobError = nullptr;			// set by the Wi-Fi job that is running if it fails, see NetworkJobTask
 static volatile WiFiState currentState = WiFiState::idle,
 				lastReportedState = WiFiState::disabled;
 
 static HSPIClass hspi;
-static uint32_t transferBuffer[NumDwords(MaxDataLength + 1)];
+static uint32_t transferBuffer[NumDwords(MaxSpiDataLength + 1)];
+static size_t maxDataLength = MaxDataLength;		// the largest data part of an exchange, as negotiated with the SAM
+
+static_assert(MaxSpiDataLength >= MaxDataLength && MaxSpiDataLength <= UINT16_MAX, "Bad MaxSpiDataLength");
+static_assert(MaxSpiDataLength % sizeof(uint32_t) == 0, "MaxSpiDataLength must be a whole number of dwords");
 
 static TaskHandle_t mainTaskHdl;
 static TaskHandle_t connPollTaskHdl;
 static TimerHandle_t tfrReqExpTmr;
 
+// TransferReady edges are latched by TransferReadyIsr, so that the main task can sleep until the SAM is ready
+static volatile bool samTfrEdge = false;			// TransferReady has changed since the last transaction started
+static volatile uint32_t samTfrEdgeMicros = 0;		// when it last changed
+static uint32_t lastTransactionMillis = 0;			// when the last transaction started
+
+// Histogram of the time from TransferReady going high to CS being asserted. Bucket n counts times below 2^(n+1) microseconds.
+static const size_t NumReadyLatencyBuckets = 16;
+static uint32_t readyLatency[NumReadyLatencyBuckets];
+static uint32_t readyTimeouts = 0;					// transactions started because no edge was seen within TransferReadyTimeout
+
 static const char* WIFI_EVENT_EXT = "wifi_event_ext";
 
 static WirelessConfigurationMgr *wirelessConfigMgr;
@@ -149,6 +168,7 @@ typedef enum {
 	TFR_REQUEST = 1,
 	TFR_REQUEST_TIMEOUT = 2,
 	SAM_TFR_READY = 4,
+	CONN_EVENT = 8,
 } main_task_evt_t;
 
 typedef enum {
@@ -168,7 +188,7 @@ void FactoryReset()
 // Check socket number in range, returning true if yes. Otherwise, set lastError and return false;
 bool ValidSocketNumber(uint8_t num)
 {
-	if (num < MaxConnections)
+	if (num < Connection::GetNumSockets())
 	{
 		return true;
 	}
@@ -206,7 +226,7 @@ static void StatePrintTask(void* data)
 			printf("gateway: %d.%d.%d.%d\n", ip[0], ip[1], ip[2], ip[3]);
 		}
 
-		uint16_t connected, otherEndClosed;
+		uint32_t connected, otherEndClosed;
 		Connection::GetSummarySocketStatus(connected, otherEndClosed);
 		printf("connected_sockets: 0x%x other_end_closed_sockets: 0x%x\n", connected, otherEndClosed);
 		Connection::ReportConnections();
@@ -607,7 +627,7 @@ int ScanForNetworks(const char *reqSsid, uint8_t mac[6], int8_t &channel, Wirele
 
 	if (res != ESP_OK) {
 		esp_wifi_stop();
-		lastError = "network scan failed";
+		jobError = "network scan failed";
 		return -1;
 	}
 
@@ -679,7 +699,7 @@ pre(currentState == WiFiState::idle)
 
 	if (ssidIdx <= 0)
 	{
-		lastError = "no known networks found";
+		jobError = "no known networks found";
 		return;
 	}
 
@@ -735,7 +755,7 @@ pre(currentState == WiFiState::idle)
 
 		if (base == nullptr)
 		{
-			lastError = "Failed to load credentials";
+			jobError = "Failed to load credentials";
 			return;
 		}
 
@@ -774,7 +794,7 @@ pre(currentState == WiFiState::idle)
 		}
 		else
 		{
-			lastError = "Invalid 802.1x protocol";
+			jobError = "Invalid 802.1x protocol";
 			return;
 		}
 
@@ -930,21 +950,21 @@ void StartAccessPoint()
 			addr.u_addr.ip4.addr = apData.ip;
 			if (!dns.start(53, "*", addr))
 			{
-				lastError = "Failed to start DNS\n";
-				debugPrintf("%s\n", lastError);
+				jobError = "Failed to start DNS\n";
+				debugPrintf("%s\n", jobError);
 			}
 			mdns_init();
 		}
 		else
 		{
-			lastError = "Failed to start access point";
-			debugPrintf("%s\n", lastError);
+			jobError = "Failed to start access point";
+			debugPrintf("%s\n", jobError);
 		}
 	}
 	else
 	{
-		lastError = "invalid access point configuration";
-		debugPrintf("%s\n", lastError);
+		jobError = "invalid access point configuration";
+		debugPrintf("%s\n", jobError);
 	}
 }
 
@@ -961,15 +981,130 @@ static union
 } messageHeaderOut;
 
 
+// Wi-Fi jobs. Connecting to an access point scans for networks first, and stopping waits for Wi-Fi to stop, which can take seconds.
+// The job task does these so that the main task can carry on serving the SAM and the sockets.
+struct NetworkJob
+{
+	NetworkCommand command;
+	char ssid[SsidLength + 1];		// for networkStartClient, the access point to connect to, or empty for the strongest known one
+};
+
+static QueueHandle_t jobQueue;
+static TaskHandle_t jobTaskHdl;
+static volatile uint32_t jobsQueued = 0;
+static volatile uint32_t jobsDone = 0;
+static volatile const char* lastJobError = nullptr;		// the error from the last job to finish, or nullptr
+static uint32_t jobsReported = 0;						// how many finished jobs the main task has taken the errors from
+static volatile uint32_t lastJobMillis = 0;
+static volatile NetworkCommand runningJob = NetworkCommand::nullCommand;
+static volatile NetworkCommand lastJob = NetworkCommand::nullCommand;
+static volatile bool lastJobFailed = false;
+
+static bool JobPending()
+{
+	return jobsDone != jobsQueued;
+}
+
+// Called by the main task
+static bool QueueJob(const NetworkJob& job)
+{
+	++jobsQueued;							// count it first, so that jobsDone never gets ahead
+	if (xQueueSendToBack(jobQueue, &job, 0) != pdTRUE)
+	{
+		--jobsQueued;
+		return false;
+	}
+	return true;
+}
+
+// The part of networkStop that waits. The main task has already terminated the sockets and stopped listening.
+static void StopWiFi()
+{
+	switch (currentState)
+	{
+	case WiFiState::connected:
+	case WiFiState::connecting:
+	case WiFiState::reconnecting:
+		RemoveMdnsServices();
+		delay(20);									// try to give lwip time to recover from stopping everything
+		esp_wifi_stop();
+		break;
+
+	case WiFiState::runningAsAccessPoint:
+		dns.stop();
+		delay(20);									// try to give lwip time to recover from stopping everything
+		esp_wifi_stop();
+		break;
+
+	default:
+		break;
+	}
+
+	while (currentState != WiFiState::idle)
+	{
+		delay(100);
+	}
+
+	usingDhcpc = false;
+	numWifiReconnects = 0;
+	currentSsid = -1;
+}
+
+static void NetworkJobTask(void* data)
+{
+	NetworkJob job;
+	for (;;)
+	{
+		if (xQueueReceive(jobQueue, &job, portMAX_DELAY) != pdTRUE)
+		{
+			continue;
+		}
+
+		runningJob = job.command;
+		const uint32_t startTime = millis();
+
+		// The following functions must set up jobError if an error occurs. The main task passes it on as lastError,
+		// so that we never overwrite an error that the main task has just set.
+		jobError = nullptr;									// assume no error
+		switch (job.command)
+		{
+		case NetworkCommand::networkStartClient:			// connect to an access point
+			StartClient((job.ssid[0] == 0) ? nullptr : job.ssid);
+			break;
+
+		case NetworkCommand::networkStartAccessPoint:		// run as an access point
+			StartAccessPoint();
+			break;
+
+		case NetworkCommand::networkStop:					// disconnect from an access point, or close down our own access point
+			StopWiFi();
+			break;
+
+		default:
+			jobError = "bad job";
+			break;
+		}
+
+		lastJobError = jobError;
+		lastJobFailed = (jobError != nullptr);
+		lastJobMillis = millis() - startTime;
+		lastJob = job.command;
+		runningJob = NetworkCommand::nullCommand;
+		++jobsDone;
+		xTaskNotify(mainTaskHdl, TFR_REQUEST, eSetBits);	// tell the SAM that the state or the last error may have changed
+	}
+}
+
 // Send a response.
 // 'response' is the number of byes of response if positive, or the error code if negative.
 // Use only to respond to commands which don't include a data block, or when we don't want to read the data block.
+// The data is queued, so the transfer buffer must not be changed until the transaction has ended.
 void SendResponse(int32_t response)
 {
 	(void)hspi.transfer32(response);
 	if (response > 0)
 	{
-		hspi.transferDwords(transferBuffer, nullptr, NumDwords((size_t)response));
+		hspi.queueDwords(transferBuffer, nullptr, NumDwords((size_t)response));
 	}
 }
 
@@ -1024,6 +1159,362 @@ WiFiAuth EspAuthModeToWiFiAuth(wifi_auth_mode_t authmode)
 	return res;
 }
 
+// Get the signal strength of the access point we are connected to, or INT8_MIN if we are not connected as a station
+int8_t GetStationRssi()
+{
+	int8_t rssi = INT8_MIN;
+	if (currentState == WiFiState::connected)
+	{
+		wifi_ap_record_t ap_info;
+		ap_info.rssi = 0;
+		esp_wifi_sta_get_ap_info(&ap_info);
+		rssi = ap_info.rssi;
+	}
+	return rssi;
+}
+
+// Fill in the status of one socket, including the summary status for all sockets
+void GetConnStatus(uint8_t socketNumber, ConnStatusResponse& resp)
+{
+	Connection::Get(socketNumber).GetStatus(resp);
+	Connection::GetSummarySocketStatus(resp.connectedSocketsWide, resp.otherEndClosedSocketsWide);
+	resp.connectedSockets = (uint16_t)resp.connectedSocketsWide;
+	resp.otherEndClosedSockets = (uint16_t)resp.otherEndClosedSocketsWide;
+
+	// Evaluate RSSI here, since the WiFi connection is managed here.
+	resp.rssi = GetStationRssi();
+}
+
+// Return the length of the status of all sockets
+static inline size_t AllConnStatusLength()
+{
+	return offsetof(AllConnStatusResponse, sockets) + Connection::GetNumSockets() * sizeof(ConnStatusResponse);
+}
+
+// Return the length of the status of one socket that we can send in the space the SAM has
+static inline size_t ConnStatusLength(size_t available)
+{
+	return (available >= sizeof(ConnStatusResponse)) ? sizeof(ConnStatusResponse) : LegacyConnStatusLength;
+}
+
+// Fill in the status of all sockets, returning the length of the response
+size_t GetAllConnStatus(AllConnStatusResponse& resp)
+{
+	const size_t numSockets = Connection::GetNumSockets();
+	const size_t length = AllConnStatusLength();
+	memset(&resp, 0, length);
+	Connection::GetSummarySocketStatus(resp.connectedSockets, resp.otherEndClosedSockets);
+	resp.rssi = GetStationRssi();
+	resp.numSockets = numSockets;
+	resp.reapedSockets = Connection::TakeReapedSockets();
+	const size_t sharedSegments = Connection::SharedWriteSegments();
+	for (size_t i = 0; i < numSockets; ++i)
+	{
+		Connection::Get(i).GetStatus(resp.sockets[i], sharedSegments);
+	}
+	return length;
+}
+
+// Write the accepted part of the data that the SAM asked us to write to a connection
+void WriteToConnection(Connection& conn, const uint8_t *data, size_t acceptedLength, size_t requestedLength, uint8_t flags)
+{
+	const bool closeAfterSending = (acceptedLength == requestedLength) && (flags & MessageHeaderSamToEsp::FlagCloseAfterWrite) != 0;
+	const bool push = (acceptedLength == requestedLength) && (flags & MessageHeaderSamToEsp::FlagPush) != 0;
+	const size_t written = conn.Write(data, acceptedLength, push, closeAfterSending);
+	if (written != acceptedLength)
+	{
+		lastError = "incomplete write";
+	}
+}
+
+// Execute one sub-command of a batched request that is not a connWrite, putting any data it returns in 'data'
+int32_t ProcessBatchSubCommand(const BatchSubCommand& cmd, uint8_t *data, size_t dataBufferAvailable)
+{
+	if (cmd.command != NetworkCommand::connGetAllStatus && !ValidSocketNumber(cmd.socketNumber))
+	{
+		return ResponseBadParameter;
+	}
+
+	switch (cmd.command)
+	{
+	case NetworkCommand::connAbort:
+		Connection::Get(cmd.socketNumber).Terminate(true);
+		return ResponseEmpty;
+
+	case NetworkCommand::connClose:
+		Connection::Get(cmd.socketNumber).Close();
+		return ResponseEmpty;
+
+	case NetworkCommand::connRead:
+		return Connection::Get(cmd.socketNumber).Read(data, std::min<size_t>(cmd.dataBufferAvailable, dataBufferAvailable));
+
+	case NetworkCommand::connGetStatus:
+		{
+			const size_t available = std::min<size_t>(cmd.dataBufferAvailable, dataBufferAvailable);
+			if (available < LegacyConnStatusLength)
+			{
+				return ResponseBufferTooSmall;
+			}
+			// Older SAM firmware may only have room for the legacy part, so don't write any more than that
+			ConnStatusResponse resp;
+			GetConnStatus(cmd.socketNumber, resp);
+			const size_t length = ConnStatusLength(available);
+			memcpy(data, &resp, length);
+			return length;
+		}
+
+	case NetworkCommand::connGetAllStatus:
+		if (std::min<size_t>(cmd.dataBufferAvailable, dataBufferAvailable) < AllConnStatusLength())
+		{
+			return ResponseBufferTooSmall;
+		}
+		return GetAllConnStatus(*reinterpret_cast<AllConnStatusResponse*>(data));
+
+	case NetworkCommand::connGetEvents:
+		if (std::min<size_t>(cmd.dataBufferAvailable, dataBufferAvailable) < sizeof(ConnEventsResponse))
+		{
+			return ResponseBufferTooSmall;
+		}
+		Connection::GetEvents(*reinterpret_cast<ConnEventsResponse*>(data));
+		return sizeof(ConnEventsResponse);
+
+	case NetworkCommand::connGetStats:
+		if (std::min<size_t>(cmd.dataBufferAvailable, dataBufferAvailable) < sizeof(ConnStatsResponse))
+		{
+			return ResponseBufferTooSmall;
+		}
+		Connection::Get(cmd.socketNumber).GetStats(*reinterpret_cast<ConnStatsResponse*>(data));
+		return sizeof(ConnStatsResponse);
+
+	default:
+		return ResponseUnknownCommand;
+	}
+}
+
+#if CONFIG_DWSS_CPU_STATS
+
+#ifndef configRUN_TIME_COUNTER_TYPE
+#define configRUN_TIME_COUNTER_TYPE		uint32_t		// older FreeRTOS versions always use 32 bits
+#endif
+
+// Print how busy each core has been since the last report, and the share of one core that each task has had since startup and where it runs.
+// Each core's idle task counts the time that the core had nothing else to do.
+static void ReportCpuUsage()
+{
+	static configRUN_TIME_COUNTER_TYPE lastTotal = 0;
+	static configRUN_TIME_COUNTER_TYPE lastIdle[portNUM_PROCESSORS] = { 0 };
+
+	UBaseType_t numTasks = uxTaskGetNumberOfTasks();
+	TaskStatus_t * const tasks = (TaskStatus_t *)malloc(numTasks * sizeof(TaskStatus_t));
+	if (tasks == nullptr)
+	{
+		return;
+	}
+
+	configRUN_TIME_COUNTER_TYPE total = 0;
+	numTasks = uxTaskGetSystemState(tasks, numTasks, &total);
+	configRUN_TIME_COUNTER_TYPE idle[portNUM_PROCESSORS] = { 0 };
+	for (UBaseType_t i = 0; i < numTasks; ++i)
+	{
+		if (strncmp(tasks[i].pcTaskName, "IDLE", 4) == 0 && tasks[i].xCoreID >= 0 && tasks[i].xCoreID < portNUM_PROCESSORS)
+		{
+			idle[tasks[i].xCoreID] = tasks[i].ulRunTimeCounter;
+		}
+	}
+
+	const uint64_t elapsed = total - lastTotal;
+	ets_printf("CPU busy:");
+	for (size_t core = 0; core < portNUM_PROCESSORS; ++core)
+	{
+		const uint64_t idleTime = std::min<uint64_t>(idle[core] - lastIdle[core], elapsed);
+		ets_printf(" core %u %u%%", core, (elapsed == 0) ? 0 : (unsigned int)(100 - idleTime * 100 / elapsed));
+		lastIdle[core] = idle[core];
+	}
+	ets_printf("\n");
+	lastTotal = total;
+
+	for (UBaseType_t i = 0; i < numTasks; ++i)
+	{
+		ets_printf("%s: core %d, %u%%\n", tasks[i].pcTaskName, (tasks[i].xCoreID < portNUM_PROCESSORS) ? (int)tasks[i].xCoreID : -1,
+					(total == 0) ? 0 : (unsigned int)((uint64_t)tasks[i].ulRunTimeCounter * 100 / total));
+	}
+	free(tasks);
+}
+
+#endif
+
+// Pipelined commands. The command is executed after its transaction, and the result is sent in the next pipelined transaction.
+// The result needs a buffer of its own, because other commands may use the transfer buffer before the SAM collects it.
+static uint32_t pipelineBuffer[NumDwords(sizeof(AllConnStatusResponse))];
+static BatchSubCommand pipelinedCommand;
+static bool pipelinePending = false;		// pipelinedCommand is waiting to be executed
+static bool pipelineReady = false;			// pipelinedResponse and pipelineBuffer hold a result that the SAM has not collected
+static int32_t pipelinedResponse;
+
+// Counters for the diagnostics report
+static uint32_t pipelinedCommands = 0;
+static uint32_t pipelinedMicros = 0;		// time spent executing them, which would otherwise have been spent in transactions
+
+static bool CanPipeline(const MessageHeaderSamToEsp& hdr)
+{
+	if ((hdr.flags & MessageHeaderSamToEsp::FlagPipelined) == 0 || hdr.dataLength != 0)
+	{
+		return false;
+	}
+
+	switch (hdr.command)
+	{
+	case NetworkCommand::nullCommand:
+	case NetworkCommand::connGetStatus:
+	case NetworkCommand::connGetAllStatus:
+	case NetworkCommand::connGetEvents:
+	case NetworkCommand::connGetStats:
+		return true;
+
+	default:
+		return false;
+	}
+}
+
+// Send the result of the previous pipelined command, and keep this one to execute when the transaction has ended.
+// The header has already been exchanged, except for the last dword.
+static void ProcessPipelined(size_t dataBufferAvailable)
+{
+	int32_t response = ResponseEmpty;
+	if (pipelineReady)
+	{
+		if (pipelinedResponse > 0 && (size_t)pipelinedResponse > dataBufferAvailable)
+		{
+			// Keep the result for next time, because some results such as the events can't be worked out again
+			(void)hspi.transfer32(ResponseBufferTooSmall);
+			return;
+		}
+		response = pipelinedResponse;
+		pipelineReady = false;
+	}
+
+	(void)hspi.transfer32(response);
+	if (response > 0)
+	{
+		hspi.queueDwords(pipelineBuffer, nullptr, NumDwords((size_t)response));
+	}
+
+	if (messageHeaderIn.hdr.command != NetworkCommand::nullCommand)
+	{
+		pipelinedCommand.command = messageHeaderIn.hdr.command;
+		pipelinedCommand.socketNumber = messageHeaderIn.hdr.socketNumber;
+		pipelinedCommand.flags = messageHeaderIn.hdr.flags;
+		pipelinedCommand.dataLength = 0;
+		pipelinedCommand.dataBufferAvailable = dataBufferAvailable;
+		pipelinePending = true;
+	}
+}
+
+// Called between transactions to execute the pipelined command, if there is one
+static void RunPipelined()
+{
+	if (pipelinePending)
+	{
+		const int64_t start = esp_timer_get_time();
+		pipelinedResponse = ProcessBatchSubCommand(pipelinedCommand, reinterpret_cast<uint8_t*>(pipelineBuffer),
+													std::min<size_t>(pipelinedCommand.dataBufferAvailable, sizeof(pipelineBuffer)));
+		pipelinePending = false;
+		pipelineReady = true;
+		pipelinedMicros += (uint32_t)(esp_timer_get_time() - start);
+		++pipelinedCommands;
+	}
+}
+
+// Process a batched request. The header has already been exchanged, except for the last dword.
+void ProcessBatch()
+{
+	if (messageHeaderIn.hdr.dataLength > maxDataLength || messageHeaderIn.hdr.dataLength < sizeof(BatchRequestHeader))
+	{
+		SendResponse(ResponseBadDataLength);
+		return;
+	}
+
+	// Once we have taken the request block we must always send a reply block, so check now that there is room for its header
+	const size_t replyLimit = std::min<size_t>(messageHeaderIn.hdr.dataBufferAvailable, maxDataLength);
+	if (replyLimit < sizeof(BatchReplyHeader))
+	{
+		SendResponse(ResponseBufferTooSmall);
+		return;
+	}
+
+	messageHeaderIn.hdr.param32 = hspi.transfer32(ResponseEmpty);
+	hspi.transferDwords(nullptr, transferBuffer, NumDwords(messageHeaderIn.hdr.dataLength));
+
+	// Copy the sub-commands out of the transfer buffer, because we build the reply in it
+	const uint8_t * const request = reinterpret_cast<const uint8_t*>(transferBuffer);
+	size_t numCommands = reinterpret_cast<const BatchRequestHeader*>(request)->numCommands;
+	BatchSubCommand cmds[MaxBatchCommands];
+	int32_t responses[MaxBatchCommands];
+	size_t requestOffset = sizeof(BatchRequestHeader) + numCommands * sizeof(BatchSubCommand);
+	if (numCommands > MaxBatchCommands || requestOffset > messageHeaderIn.hdr.dataLength)
+	{
+		lastError = "bad batch request";
+		numCommands = 0;							// reply with just the header
+	}
+	else if (sizeof(BatchReplyHeader) + numCommands * sizeof(int32_t) > replyLimit)
+	{
+		lastError = "no room for batch reply";
+		numCommands = 0;
+	}
+	else
+	{
+		memcpy(cmds, request + sizeof(BatchRequestHeader), numCommands * sizeof(BatchSubCommand));
+	}
+
+	// Execute the writes first, while their data is still in the transfer buffer
+	for (size_t i = 0; i < numCommands; ++i)
+	{
+		if (cmds[i].command == NetworkCommand::connWrite)
+		{
+			const size_t dataLength = cmds[i].dataLength;
+			if (requestOffset + dataLength > messageHeaderIn.hdr.dataLength)
+			{
+				responses[i] = ResponseBadDataLength;
+			}
+			else if (ValidSocketNumber(cmds[i].socketNumber))
+			{
+				Connection& conn = Connection::Get(cmds[i].socketNumber);
+				const size_t acceptedLength = std::min<size_t>(conn.CanWrite(), std::min<size_t>(dataLength, maxDataLength));
+				WriteToConnection(conn, request + requestOffset, acceptedLength, dataLength, cmds[i].flags);
+				responses[i] = acceptedLength;
+			}
+			else
+			{
+				responses[i] = ResponseBadParameter;
+			}
+			requestOffset += NumDwords(dataLength) * sizeof(uint32_t);
+		}
+	}
+
+	// Now execute the remaining commands, building the reply in the transfer buffer
+	uint8_t * const reply = reinterpret_cast<uint8_t*>(transferBuffer);
+	size_t replyLength = sizeof(BatchReplyHeader) + numCommands * sizeof(int32_t);
+	for (size_t i = 0; i < numCommands; ++i)
+	{
+		if (cmds[i].command != NetworkCommand::connWrite)
+		{
+			const size_t available = (replyLength < replyLimit) ? (replyLimit - replyLength) & ~(sizeof(uint32_t) - 1) : 0;
+			responses[i] = ProcessBatchSubCommand(cmds[i], reply + replyLength, available);
+			if (responses[i] > 0)
+			{
+				replyLength += NumDwords(responses[i]) * sizeof(uint32_t);
+			}
+		}
+	}
+
+	BatchReplyHeader * const replyHeader = reinterpret_cast<BatchReplyHeader*>(reply);
+	replyHeader->numResponses = numCommands;
+	replyHeader->dummy = 0;
+	replyHeader->dataLength = replyLength;
+	memcpy(reply + sizeof(BatchReplyHeader), responses, numCommands * sizeof(int32_t));
+	hspi.queueDwords(transferBuffer, nullptr, NumDwords(replyLength));
+}
+
 // This is called when the SAM is asking to transfer data
 void ProcessRequest()
 {
@@ -1031,6 +1522,11 @@ void ProcessRequest()
 	messageHeaderIn.hdr.formatVersion = InvalidFormatVersion;
 	messageHeaderOut.hdr.formatVersion = MyFormatVersion;
 	messageHeaderOut.hdr.state = currentState;
+	messageHeaderOut.hdr.capabilities = MessageHeaderEspToSam::CapabilityBatch | MessageHeaderEspToSam::CapabilityLargeFrames
+										| MessageHeaderEspToSam::CapabilityEvents | MessageHeaderEspToSam::CapabilityManySockets
+										| MessageHeaderEspToSam::CapabilityConnectByName | MessageHeaderEspToSam::CapabilityPipelined;
+	messageHeaderOut.hdr.maxDataLength = MaxSpiDataLength;
+	messageHeaderOut.hdr.numSockets = NumConnections;
 	bool deferCommand = false;
 
 #ifdef DEBUG
@@ -1038,23 +1534,50 @@ void ProcessRequest()
 #endif
 
 	// Begin the transaction
+	if (samTfrEdge)
+	{
+		const uint32_t latency = (uint32_t)esp_timer_get_time() - samTfrEdgeMicros;
+		size_t bucket = 0;
+		while (bucket + 1 < NumReadyLatencyBuckets && (latency >> (bucket + 1)) != 0)
+		{
+			++bucket;
+		}
+		++readyLatency[bucket];
+	}
+	samTfrEdge = false;					// from now on, an edge means that the SAM is getting ready for the next transaction
+	lastTransactionMillis = millis();
 	gpio_set_level(SamSSPin, 0);		// assert CS to SAM
 	hspi.beginTransaction();
 
 	// Exchange headers, except for the last dword which will contain our response
 	hspi.transferDwords(messageHeaderOut.asDwords, messageHeaderIn.asDwords, headerDwords - 1);
 
-	if (messageHeaderIn.hdr.formatVersion != MyFormatVersion)
+	if (messageHeaderIn.hdr.formatVersion == BatchFormatVersion)
+	{
+#ifdef DEBUG
+		commandsProcessed++;
+#endif
+		ProcessBatch();
+	}
+	else if (messageHeaderIn.hdr.formatVersion != MyFormatVersion)
 	{
 		SendResponse(ResponseBadRequestFormatVersion);
 	}
-	else if (messageHeaderIn.hdr.dataLength > MaxDataLength)
+	else if (messageHeaderIn.hdr.dataLength > maxDataLength)
 	{
 		SendResponse(ResponseBadDataLength);
 	}
+	else if (CanPipeline(messageHeaderIn.hdr))
+	{
+#ifdef DEBUG
+		lastCommand = messageHeaderIn.hdr.command;
+		commandsProcessed++;
+#endif
+		ProcessPipelined(std::min<size_t>(messageHeaderIn.hdr.dataBufferAvailable, maxDataLength));
+	}
 	else
 	{
-		const size_t dataBufferAvailable = std::min<size_t>(messageHeaderIn.hdr.dataBufferAvailable, MaxDataLength);
+		const size_t dataBufferAvailable = std::min<size_t>(messageHeaderIn.hdr.dataBufferAvailable, maxDataLength);
 
 #ifdef DEBUG
 		lastCommand = messageHeaderIn.hdr.command;
@@ -1069,7 +1592,11 @@ void ProcessRequest()
 			break;
 
 		case NetworkCommand::networkStartClient:			// connect to an access point
-			if (currentState == WiFiState::idle && scanState != WIFI_SCANNING)
+			if (JobPending())
+			{
+				SendResponse(ResponseBusy);					// wait for the last job to finish
+			}
+			else if (currentState == WiFiState::idle && scanState != WIFI_SCANNING)
 			{
 				deferCommand = true;
 				messageHeaderIn.hdr.param32 = hspi.transfer32(ResponseEmpty);
@@ -1086,7 +1613,11 @@ void ProcessRequest()
 			break;
 
 		case NetworkCommand::networkStartAccessPoint:		// run as an access point
-			if (currentState == WiFiState::idle && scanState != WIFI_SCANNING)
+			if (JobPending())
+			{
+				SendResponse(ResponseBusy);					// wait for the last job to finish
+			}
+			else if (currentState == WiFiState::idle && scanState != WIFI_SCANNING)
 			{
 				deferCommand = true;
 				messageHeaderIn.hdr.param32 = hspi.transfer32(ResponseEmpty);
@@ -1098,8 +1629,15 @@ void ProcessRequest()
 			break;
 
 		case NetworkCommand::networkFactoryReset:			// clear remembered list, reset factory defaults
-			messageHeaderIn.hdr.param32 = hspi.transfer32(ResponseEmpty);
-			FactoryReset();
+			if (JobPending())
+			{
+				SendResponse(ResponseBusy);					// the job task may be reading the SSID store
+			}
+			else
+			{
+				messageHeaderIn.hdr.param32 = hspi.transfer32(ResponseEmpty);
+				FactoryReset();
+			}
 			break;
 
 		case NetworkCommand::networkStop:					// disconnect from an access point, or close down our own access point
@@ -1269,7 +1807,11 @@ void ProcessRequest()
 
 		case NetworkCommand::networkAddSsid:				// add to our known access point list
 		case NetworkCommand::networkConfigureAccessPoint:	// configure our own access point details
-			if (messageHeaderIn.hdr.dataLength == sizeof(WirelessConfigurationData))
+			if (JobPending())
+			{
+				SendResponse(ResponseBusy);					// the job task may be reading the SSID store
+			}
+			else if (messageHeaderIn.hdr.dataLength == sizeof(WirelessConfigurationData))
 			{
 				messageHeaderIn.hdr.param32 = hspi.transfer32(ResponseEmpty);
 				hspi.transferDwords(nullptr, transferBuffer, NumDwords(sizeof(WirelessConfigurationData)));
@@ -1295,7 +1837,11 @@ void ProcessRequest()
 				static int32_t addErr = false;
 
 				AddEnterpriseSsidFlag flag = static_cast<AddEnterpriseSsidFlag>(messageHeaderIn.hdr.flags);
-				if (flag == AddEnterpriseSsidFlag::SSID) // add ssid info
+				if (JobPending())
+				{
+					SendResponse(ResponseBusy);				// every step writes to the SSID store, which the job task may be reading
+				}
+				else if (flag == AddEnterpriseSsidFlag::SSID) // add ssid info
 				{
 					if (!pending)
 					{
@@ -1400,7 +1946,11 @@ void ProcessRequest()
 			break;
 
 		case NetworkCommand::networkDeleteSsid:				// delete a network from our access point list
-			if (messageHeaderIn.hdr.dataLength == SsidLength)
+			if (JobPending())
+			{
+				SendResponse(ResponseBusy);					// the job task may be reading the SSID store
+			}
+			else if (messageHeaderIn.hdr.dataLength == SsidLength)
 			{
 				messageHeaderIn.hdr.param32 = hspi.transfer32(ResponseEmpty);
 				hspi.transferDwords(nullptr, transferBuffer, NumDwords(SsidLength));
@@ -1516,7 +2066,11 @@ void ProcessRequest()
 			break;
 
 		case NetworkCommand::networkStartScan:
-			if ((scanState == WIFI_SCAN_IDLE || scanState == WIFI_SCAN_DONE) &&
+			if (JobPending())
+			{
+				SendResponse(ResponseBusy);					// starting or stopping Wi-Fi would upset the scan
+			}
+			else if ((scanState == WIFI_SCAN_IDLE || scanState == WIFI_SCAN_DONE) &&
 				(currentState == WiFiState::idle || currentState == WiFiState::connected))
 			{
 				// Defer scan execution, as this can take a long time and cause a timeout
@@ -1537,8 +2091,8 @@ void ProcessRequest()
 
 				if (wifiScanNum > 0) {
 					// By default the records are sorted by signal strength, so just
-					// send all ap records that fit the transfer buffer.
-					for (int i = 0; i < wifiScanNum && data_sz <= sizeof(transferBuffer); i++, data_sz += sizeof(WiFiScanData))
+					// send all ap records that fit the SAM's buffer.
+					for (int i = 0; i < wifiScanNum && data_sz + sizeof(WiFiScanData) <= dataBufferAvailable; i++, data_sz += sizeof(WiFiScanData))
 					{
 						const wifi_ap_record_t& ap = wifiScanAPs[i];
 						WiFiScanData &d = reinterpret_cast<WiFiScanData*>(transferBuffer)[i];
@@ -1586,7 +2140,8 @@ void ProcessRequest()
 				messageHeaderIn.hdr.param32 = hspi.transfer32(ResponseEmpty);
 				ListenOrConnectData lcData;
 				hspi.transferDwords(nullptr, reinterpret_cast<uint32_t*>(&lcData), NumDwords(sizeof(lcData)));
-				const bool ok = Listener::Start(lcData.port, lcData.remoteIp, lcData.protocol, lcData.maxConnections);
+				const bool ok = Listener::Start(lcData.port, lcData.remoteIp, lcData.protocol, lcData.maxConnections,
+													lcData.priority, std::min(lcData.reservedConnections, lcData.maxConnections));
 				if (ok)
 				{
 					if (lcData.protocol < 3)			// if it's FTP, HTTP or Telnet protocol
@@ -1641,13 +2196,64 @@ void ProcessRequest()
 			}
 			break;
 
+		case NetworkCommand::connSetOptions:			// set TCP options for a socket
+			if (messageHeaderIn.hdr.dataLength != sizeof(ConnOptionsData))
+			{
+				SendResponse(ResponseBadDataLength);
+			}
+			else if (ValidSocketNumber(messageHeaderIn.hdr.socketNumber))
+			{
+				messageHeaderIn.hdr.param32 = hspi.transfer32(ResponseEmpty);
+				ConnOptionsData options;
+				hspi.transferDwords(nullptr, reinterpret_cast<uint32_t*>(&options), NumDwords(sizeof(options)));
+				if (!Connection::Get(messageHeaderIn.hdr.socketNumber).SetOptions(options))
+				{
+					lastError = "socket not open";
+				}
+			}
+			else
+			{
+				messageHeaderIn.hdr.param32 = hspi.transfer32(ResponseBadParameter);
+			}
+			break;
+
+		case NetworkCommand::networkSetIdleTimeouts:	// set how long sockets may be idle before we reap them
+			if (messageHeaderIn.hdr.dataLength == sizeof(IdleTimeoutsData))
+			{
+				messageHeaderIn.hdr.param32 = hspi.transfer32(ResponseEmpty);
+				IdleTimeoutsData timeouts;
+				hspi.transferDwords(nullptr, reinterpret_cast<uint32_t*>(&timeouts), NumDwords(sizeof(timeouts)));
+				Connection::SetIdleTimeouts(timeouts);
+			}
+			else
+			{
+				SendResponse(ResponseBadDataLength);
+			}
+			break;
+
 		case NetworkCommand::connRead:					// read data from a connection
 			if (ValidSocketNumber(messageHeaderIn.hdr.socketNumber))
 			{
 				Connection& conn = Connection::Get(messageHeaderIn.hdr.socketNumber);
-				const size_t amount = conn.Read(reinterpret_cast<uint8_t *>(transferBuffer), std::min<size_t>(messageHeaderIn.hdr.dataBufferAvailable, MaxDataLength));
-				messageHeaderIn.hdr.param32 = hspi.transfer32(amount);
-				hspi.transferDwords(transferBuffer, nullptr, NumDwords(amount));
+				const size_t length = std::min<size_t>(messageHeaderIn.hdr.dataBufferAvailable, maxDataLength);
+				size_t amount;
+#if CONFIG_DWSS_READ_PREFETCH_BUFFERS
+				const uint32_t * const staged = conn.GetStagedRead(length, amount);
+				if (staged != nullptr)
+				{
+					messageHeaderIn.hdr.param32 = hspi.transfer32(amount);
+					hspi.queueDwords(staged, nullptr, NumDwords(amount));	// already copied into a DMA buffer between transactions
+				}
+				else
+#endif
+				{
+					SpiChunk chunks[MaxReadChunks];
+					size_t numChunks;
+					amount = conn.GetReadChunks(chunks, numChunks, MaxReadChunks, length);
+					messageHeaderIn.hdr.param32 = hspi.transfer32(amount);
+					hspi.transferScatter(chunks, numChunks);		// send the data straight from the receive buffers
+				}
+				conn.ConsumeRead(amount);
 			}
 			else
 			{
@@ -1660,16 +2266,10 @@ void ProcessRequest()
 			{
 				Connection& conn = Connection::Get(messageHeaderIn.hdr.socketNumber);
 				const size_t requestedlength = messageHeaderIn.hdr.dataLength;
-				const size_t acceptedLength = std::min<size_t>(conn.CanWrite(), std::min<size_t>(requestedlength, MaxDataLength));
-				const bool closeAfterSending = (acceptedLength == requestedlength) && (messageHeaderIn.hdr.flags & MessageHeaderSamToEsp::FlagCloseAfterWrite) != 0;
-				const bool push = (acceptedLength == requestedlength) && (messageHeaderIn.hdr.flags & MessageHeaderSamToEsp::FlagPush) != 0;
+				const size_t acceptedLength = std::min<size_t>(conn.CanWrite(), std::min<size_t>(requestedlength, maxDataLength));
 				messageHeaderIn.hdr.param32 = hspi.transfer32(acceptedLength);
-				hspi.transferDwords(nullptr, transferBuffer, NumDwords(acceptedLength));
-				const size_t written = conn.Write(reinterpret_cast<uint8_t *>(transferBuffer), acceptedLength, push, closeAfterSending);
-				if (written != acceptedLength)
-				{
-					lastError = "incomplete write";
-				}
+				hspi.transferDwords(nullptr, transferBuffer, NumDwords(acceptedLength));	// by DMA on the ESP32, so the only copy is the one lwIP makes
+				WriteToConnection(conn, reinterpret_cast<uint8_t *>(transferBuffer), acceptedLength, requestedlength, messageHeaderIn.hdr.flags);
 			}
 			else
 			{
@@ -1680,27 +2280,75 @@ void ProcessRequest()
 		case NetworkCommand::connGetStatus:				// get the status of a socket, and summary status for all sockets
 			if (ValidSocketNumber(messageHeaderIn.hdr.socketNumber))
 			{
-				messageHeaderIn.hdr.param32 = hspi.transfer32(sizeof(ConnStatusResponse));
-				Connection& conn = Connection::Get(messageHeaderIn.hdr.socketNumber);
+				const size_t length = ConnStatusLength(dataBufferAvailable);
+				messageHeaderIn.hdr.param32 = hspi.transfer32(length);
 				ConnStatusResponse resp;
-				conn.GetStatus(resp);
-				Connection::GetSummarySocketStatus(resp.connectedSockets, resp.otherEndClosedSockets);
+				GetConnStatus(messageHeaderIn.hdr.socketNumber, resp);
+				hspi.transferDwords(reinterpret_cast<const uint32_t *>(&resp), nullptr, NumDwords(length));
+			}
+			else
+			{
+				messageHeaderIn.hdr.param32 = hspi.transfer32(ResponseBadParameter);
+			}
+			break;
 
-				// Evaluate RSSI here, since the WiFi connection is managed here.
-				resp.rssi = INT8_MIN;
-				if (currentState == WiFiState::connected)
+		case NetworkCommand::connGetAllStatus:			// get the status of all sockets, and summary status for all sockets
+			{
+				if (dataBufferAvailable >= AllConnStatusLength())
 				{
-					wifi_ap_record_t ap_info;
-					ap_info.rssi = 0;
-					esp_wifi_sta_get_ap_info(&ap_info);
-					resp.rssi = ap_info.rssi;
+					SendResponse(GetAllConnStatus(*reinterpret_cast<AllConnStatusResponse*>(transferBuffer)));
 				}
+				else
+				{
+					SendResponse(ResponseBufferTooSmall);
+				}
+			}
+			break;
 
-				hspi.transferDwords(reinterpret_cast<const uint32_t *>(&resp), nullptr, NumDwords(sizeof(resp)));
+		case NetworkCommand::networkGetJobStatus:		// get the progress of the Wi-Fi jobs
+			if (dataBufferAvailable >= sizeof(JobStatusResponse))
+			{
+				JobStatusResponse * const response = reinterpret_cast<JobStatusResponse*>(transferBuffer);
+				response->jobsQueued = jobsQueued;
+				response->jobsDone = jobsDone;
+				response->lastJobMillis = lastJobMillis;
+				response->runningCommand = (uint8_t)runningJob;
+				response->lastCommand = (uint8_t)lastJob;
+				response->lastJobFailed = lastJobFailed;
+				response->dummy = 0;
+				SendResponse(sizeof(JobStatusResponse));
 			}
 			else
 			{
-				messageHeaderIn.hdr.param32 = hspi.transfer32(ResponseBadParameter);
+				SendResponse(ResponseBufferTooSmall);
+			}
+			break;
+
+		case NetworkCommand::connGetStats:				// get the traffic statistics of a socket
+			if (!ValidSocketNumber(messageHeaderIn.hdr.socketNumber))
+			{
+				SendResponse(ResponseBadParameter);
+			}
+			else if (dataBufferAvailable >= sizeof(ConnStatsResponse))
+			{
+				Connection::Get(messageHeaderIn.hdr.socketNumber).GetStats(*reinterpret_cast<ConnStatsResponse*>(transferBuffer));
+				SendResponse(sizeof(ConnStatsResponse));
+			}
+			else
+			{
+				SendResponse(ResponseBufferTooSmall);
+			}
+			break;
+
+		case NetworkCommand::connGetEvents:				// get and clear the socket events that the SAM has not yet fetched
+			if (dataBufferAvailable >= sizeof(ConnEventsResponse))
+			{
+				Connection::GetEvents(*reinterpret_cast<ConnEventsResponse*>(transferBuffer));
+				SendResponse(sizeof(ConnEventsResponse));
+			}
+			else
+			{
+				SendResponse(ResponseBufferTooSmall);
 			}
 			break;
 
@@ -1730,6 +2378,19 @@ void ProcessRequest()
 			deferCommand = true;
 			break;
 
+		case NetworkCommand::networkSetMaxDataLength:
+			// The requested length arrives in param32 while we send the response, so the SAM must not ask for more than we advertise
+			messageHeaderIn.hdr.param32 = hspi.transfer32(ResponseEmpty);
+			maxDataLength = std::max<size_t>(MaxDataLength, std::min<size_t>(messageHeaderIn.hdr.param32, MaxSpiDataLength)) & ~(sizeof(uint32_t) - 1);
+			Connection::SetMaxWriteLength(maxDataLength);
+			break;
+
+		case NetworkCommand::networkSetNumSockets:
+			// The requested number arrives in param32 while we send the response, so the SAM must not ask for more than we advertise
+			messageHeaderIn.hdr.param32 = hspi.transfer32(ResponseEmpty);
+			Connection::SetNumSockets(std::max<size_t>(MaxConnections, std::min<size_t>(messageHeaderIn.hdr.param32, NumConnections)));
+			break;
+
 		case NetworkCommand::connCreate:					// create a connection
 			{
 				Connection * const conn = Connection::Allocate();
@@ -1737,10 +2398,16 @@ void ProcessRequest()
 				{
 					uint32_t connNum = conn->GetNum();
 					messageHeaderIn.hdr.param32 = hspi.transfer32(connNum);
-					ListenOrConnectData lcData;
-					hspi.transferDwords(nullptr, reinterpret_cast<uint32_t*>(&lcData), NumDwords(sizeof(lcData)));
 
-					if (!conn->Connect(lcData.protocol, lcData.remoteIp, lcData.port))
+					// Older SAM firmware sends just the ListenOrConnectData
+					ConnCreateData ccData;
+					memset(&ccData, 0, sizeof(ccData));
+					const size_t length = std::max<size_t>(sizeof(ListenOrConnectData), std::min<size_t>(messageHeaderIn.hdr.dataLength, sizeof(ccData)));
+					hspi.transferDwords(nullptr, reinterpret_cast<uint32_t*>(&ccData), NumDwords(length));
+
+					char hostName[HostNameLength + 1];
+					SafeStrncpy(hostName, ccData.hostName, sizeof(hostName));
+					if (!conn->Connect(ccData.lcData.protocol, ccData.lcData.remoteIp, ccData.lcData.port, hostName, ccData.timeout))
 					{
 						lastError = "Connection creation failed";
 					}
@@ -1759,8 +2426,8 @@ void ProcessRequest()
 		}
 	}
 
+	hspi.endTransaction();					// wait for any queued data to be sent
 	gpio_set_level(SamSSPin, 1);			// de-assert CS to SAM to end the transaction and tell SAM the transfer is complete
-	hspi.endTransaction();
 
 	// If we deferred the command until after sending the response (e.g. because it may take some time to execute), complete it now
 	if (deferCommand)
@@ -1770,52 +2437,29 @@ void ProcessRequest()
 		switch (messageHeaderIn.hdr.command)
 		{
 		case NetworkCommand::networkStartClient:			// connect to an access point
-			if (messageHeaderIn.hdr.dataLength == 0 || reinterpret_cast<const char*>(transferBuffer)[0] == 0)
-			{
-				StartClient(nullptr);						// connect to strongest known access point
-			}
-			else
-			{
-				StartClient(reinterpret_cast<const char*>(transferBuffer));		// connect to specified access point
-			}
-			break;
-
 		case NetworkCommand::networkStartAccessPoint:		// run as an access point
-			StartAccessPoint();
-			break;
-
 		case NetworkCommand::networkStop:					// disconnect from an access point, or close down our own access point
-			Connection::TerminateAll();						// terminate all connections
-			Listener::Stop(0);								// stop listening on all ports
-			RebuildServices();								// remove the MDNS services
-			switch (currentState)
-			{
-			case WiFiState::connected:
-			case WiFiState::connecting:
-			case WiFiState::reconnecting:
-				RemoveMdnsServices();
-				delay(20);									// try to give lwip time to recover from stopping everything
-				esp_wifi_stop();
-				break;
-
-			case WiFiState::runningAsAccessPoint:
-				dns.stop();
-				delay(20);									// try to give lwip time to recover from stopping everything
-				esp_wifi_stop();
-				break;
-
-			default:
-				break;
-			}
-
-			while (currentState != WiFiState::idle)
 			{
-				delay(100);
-			}
+				NetworkJob job;
+				job.command = messageHeaderIn.hdr.command;
+				job.ssid[0] = 0;							// connect to strongest known access point unless the SAM named one
+				if (job.command == NetworkCommand::networkStartClient && messageHeaderIn.hdr.dataLength != 0)
+				{
+					SafeStrncpy(job.ssid, reinterpret_cast<const char*>(transferBuffer), sizeof(job.ssid));
+				}
+				else if (job.command == NetworkCommand::networkStop)
+				{
+					// The sockets and listeners belong to this task, so deal with them here and leave the job task to stop Wi-Fi
+					Connection::TerminateAll();				// terminate all connections
+					Listener::Stop(0);						// stop listening on all ports
+					RebuildServices();						// remove the MDNS services
+				}
 
-			usingDhcpc = false;
-			numWifiReconnects = 0;
-			currentSsid = -1;
+				if (!QueueJob(job))
+				{
+					lastError = "too many Wi-Fi jobs";
+				}
+			}
 			break;
 
 		case NetworkCommand::networkStartScan:
@@ -1849,6 +2493,16 @@ void ProcessRequest()
 
 		case NetworkCommand::diagnostics:
 			Connection::ReportConnections();
+			ets_printf("Pipelined commands: %u, %uus executed between transactions\n", pipelinedCommands, pipelinedMicros);
+			ets_printf("SAM ready to CS (us):");
+			for (size_t i = 0; i + 1 < NumReadyLatencyBuckets; ++i)
+			{
+				ets_printf(" <%u:%u", 2u << i, readyLatency[i]);
+			}
+			ets_printf(" >=%u:%u, ready timeouts %u\n", 1u << (NumReadyLatencyBuckets - 1), readyLatency[NumReadyLatencyBuckets - 1], readyTimeouts);
+#if CONFIG_DWSS_CPU_STATS
+			ReportCpuUsage();
+#endif
 			delay(20);										// give the Duet main processor time to digest that
 			stats_display();
 			break;
@@ -1871,8 +2525,94 @@ void ProcessRequest()
 }
 
 
+#if CONFIG_DWSS_SPI_BENCHMARK
+// Time SPI transfers of a single dword and of a full data block, to show the overhead per transaction,
+// and the throughput of whole exchanges at each frame size that the SAM can negotiate.
+// Chip select to the SAM is not asserted, so the SAM ignores these transfers.
+static void RunSpiBenchmark()
+{
+	constexpr unsigned int NumDwordTransfers = 1000;
+	constexpr unsigned int NumBlockTransfers = 100;
+	constexpr size_t BlockDwords = NumDwords(MaxDataLength);
+
+	int64_t start = esp_timer_get_time();
+	for (unsigned int i = 0; i < NumDwordTransfers; ++i)
+	{
+		(void)hspi.transfer32(0);
+	}
+	const uint32_t dwordNanos = (uint32_t)((esp_timer_get_time() - start) * 1000 / NumDwordTransfers);
+
+	start = esp_timer_get_time();
+	for (unsigned int i = 0; i < NumBlockTransfers; ++i)
+	{
+		hspi.transferDwords(transferBuffer, nullptr, BlockDwords);
+	}
+	const uint32_t blockNanos = (uint32_t)((esp_timer_get_time() - start) * 1000 / NumBlockTransfers);
+
+	start = esp_timer_get_time();
+	for (unsigned int i = 0; i < NumBlockTransfers; ++i)
+	{
+		hspi.queueDwords(transferBuffer, nullptr, BlockDwords);
+	}
+	hspi.flush();
+	const uint32_t queuedBlockNanos = (uint32_t)((esp_timer_get_time() - start) * 1000 / NumBlockTransfers);
+
+	debugPrintfAlways("SPI benchmark: 4 bytes %uns, %u bytes %uns, %u bytes queued back to back %uns\n",
+						dwordNanos, BlockDwords * sizeof(uint32_t), blockNanos, BlockDwords * sizeof(uint32_t), queuedBlockNanos);
+
+	// Measure the throughput of complete exchanges at each frame size the SAM could negotiate, including the header and response dword
+	constexpr size_t BytesPerFrameSize = 65536;
+	for (size_t frameLength = MaxDataLength; frameLength <= MaxSpiDataLength; frameLength *= 2)
+	{
+		const size_t numFrames = BytesPerFrameSize/frameLength;
+		start = esp_timer_get_time();
+		for (size_t i = 0; i < numFrames; ++i)
+		{
+			hspi.transferDwords(messageHeaderOut.asDwords, messageHeaderIn.asDwords, headerDwords - 1);
+			(void)hspi.transfer32(frameLength);
+			hspi.transferDwords(transferBuffer, nullptr, NumDwords(frameLength));
+		}
+		const int64_t micros = esp_timer_get_time() - start;
+		debugPrintfAlways("SPI benchmark: %u byte frames %ukB/s\n", frameLength, (uint32_t)((int64_t)BytesPerFrameSize * 1000000/1024/micros));
+	}
+
+#ifndef ESP8266
+	// Compare the CPU cycles taken by short transfers with and without the direct register path
+	constexpr size_t ShortDwords = NumDwords(64);
+	uint32_t dwordCycles[2], shortCycles[2];
+	for (unsigned int fast = 0; fast < 2; ++fast)
+	{
+		hspi.setFastPath(fast != 0);
+		uint32_t startCycles = esp_cpu_get_cycle_count();
+		for (unsigned int i = 0; i < NumDwordTransfers; ++i)
+		{
+			(void)hspi.transfer32(0);
+		}
+		dwordCycles[fast] = (esp_cpu_get_cycle_count() - startCycles) / NumDwordTransfers;
+
+		startCycles = esp_cpu_get_cycle_count();
+		for (unsigned int i = 0; i < NumDwordTransfers; ++i)
+		{
+			hspi.transferDwords(transferBuffer, transferBuffer, ShortDwords);
+		}
+		shortCycles[fast] = (esp_cpu_get_cycle_count() - startCycles) / NumDwordTransfers;
+	}
+#if CONFIG_DWSS_SPI_FAST_PATH
+	hspi.setFastPath(true);
+#else
+	hspi.setFastPath(false);
+#endif
+	debugPrintfAlways("SPI benchmark: 4 bytes %u cycles (%u via driver), %u bytes %u cycles (%u via driver)\n",
+						dwordCycles[1], dwordCycles[0], ShortDwords * sizeof(uint32_t), shortCycles[1], shortCycles[0]);
+#endif
+}
+#endif
+
+// Called on both edges of TransferReady. The main task reads the level, so that a pulse too short for us to see both edges is not lost.
 void IRAM_ATTR TransferReadyIsr(void* p)
 {
+	samTfrEdgeMicros = (uint32_t)esp_timer_get_time();
+	samTfrEdge = true;
 	BaseType_t woken = pdFALSE;
 	xTaskNotifyFromISR(mainTaskHdl, SAM_TFR_READY, eSetBits, &woken);
 	if (woken == pdTRUE)
@@ -1916,7 +2656,10 @@ void setup()
 	cfg.nvs_enable = false;
 	esp_wifi_init(&cfg);
 
-	xTaskCreate(WiFiConnectionTask, "wifiConnection", WIFI_CONNECTION_STACK, NULL, WIFI_CONNECTION_PRIO, &connPollTaskHdl);
+	CreateNetworkTask(WiFiConnectionTask, "wifiConnection", WIFI_CONNECTION_STACK, NULL, WIFI_CONNECTION_PRIO, &connPollTaskHdl);
+
+	jobQueue = xQueueCreate(NumQueuedJobs, sizeof(NetworkJob));
+	CreateNetworkTask(NetworkJobTask, "networkJob", NETWORK_JOB_STACK, NULL, NETWORK_JOB_PRIO, &jobTaskHdl);
 
 #ifdef DEBUG
 	xTaskCreate(StatePrintTask, "statePrint", STATE_PRINT_STACK, NULL, tskIDLE_PRIORITY, NULL);
@@ -1939,10 +2682,13 @@ void setup()
 	gpio_set_level(SamSSPin, 1);
 
 	hspi.InitMaster(SPI_MODE1, defaultClockControl, true);
+#if CONFIG_DWSS_SPI_BENCHMARK
+	RunSpiBenchmark();
+#endif
 
 	gpio_install_isr_service(ESP_INTR_FLAG_IRAM);
 	gpio_isr_handler_add(SamTfrReadyPin, TransferReadyIsr, nullptr);
-	gpio_set_intr_type(SamTfrReadyPin, GPIO_INTR_POSEDGE);
+	gpio_set_intr_type(SamTfrReadyPin, GPIO_INTR_ANYEDGE);
 
 	tfrReqExpTmr = xTimerCreate("tfrReqExpTmr", StatusReportMillis, pdFALSE, NULL,
 		[](TimerHandle_t data) {
@@ -1952,6 +2698,7 @@ void setup()
 
 	// Setup networking
 	Connection::Init();
+	Connection::SetPollTask(mainTaskHdl, CONN_EVENT);
 	Listener::Init();
 
 	lastError = nullptr;
@@ -1959,16 +2706,58 @@ void setup()
 	gpio_set_level(EspReqTransferPin, 1);					// tell the SAM we are ready to receive a command
 }
 
+// Return true if the SAM is ready for a transaction.
+// Duet WiFi 1.04 and earlier have hardware to ensure that TransferReady goes low when a transaction starts.
+// Duet 3 Mini doesn't, so we need to see TransferReady go low and then high again. Any edge since the transaction started
+// followed by a high level means that has happened. In case it happens so fast that we don't get the interrupt, we have a timeout.
+static bool SamReadyForTransaction()
+{
+	if (gpio_get_level(SamTfrReadyPin) == 0)
+	{
+		return false;
+	}
+	if (samTfrEdge)
+	{
+		return true;
+	}
+	if (millis() - lastTransactionMillis >= TransferReadyTimeout)
+	{
+		++readyTimeouts;
+		return true;
+	}
+	return false;
+}
+
+// Return how long the main task may sleep if nothing wakes it
+static TickType_t NextWakeTicks()
+{
+	uint32_t delay = Connection::NextPollDelay();
+	if (!samTfrEdge && gpio_get_level(SamTfrReadyPin) == 1)
+	{
+		// TransferReady is still high from the last transaction, so we can't tell yet whether the SAM is ready for another
+		const uint32_t elapsed = millis() - lastTransactionMillis;
+		delay = std::min<uint32_t>(delay, (elapsed >= TransferReadyTimeout) ? 0 : TransferReadyTimeout - elapsed);
+	}
+	return (delay == UINT32_MAX) ? portMAX_DELAY : (delay + portTICK_PERIOD_MS - 1) / portTICK_PERIOD_MS;
+}
+
 void loop()
 {
-	// See whether there is a request from the SAM.
-	// Duet WiFi 1.04 and earlier have hardware to ensure that TransferReady goes low when a transaction starts.
-	// Duet 3 Mini doesn't, so we need to see TransferReady go low and then high again. In case that happens so fast that we dn't get the interrupt, we have a timeout.
+	// Sleep until TransferReady changes, lwIP or another task has something for us, or a connection timer expires
 	uint32_t flags = 0;
-	xTaskNotifyWait(0, UINT_MAX, &flags, TransferReadyTimeout);
+	xTaskNotifyWait(0, UINT_MAX, &flags, NextWakeTicks());
+
+	if (jobsReported != jobsDone)
+	{
+		jobsReported = jobsDone;
+		if (lastJobError != nullptr)
+		{
+			lastError = lastJobError;						// the job task only records its error, so that it doesn't overwrite ours
+		}
+	}
 
 	if ((flags & TFR_REQUEST) || ((flags & TFR_REQUEST_TIMEOUT) &&
-		(lastError != nullptr || currentState != lastReportedState) ))
+		(lastError != nullptr || currentState != lastReportedState || Connection::EventsPending()) ))
 	{
 		ets_delay_us(2);									// make sure the pin stays high for long enough for the SAM to see it
 		gpio_set_level(EspReqTransferPin, 0);			// force a low to high transition to signal that an error message is available
@@ -1978,12 +2767,20 @@ void loop()
 		xTimerReset(tfrReqExpTmr, portMAX_DELAY);
 	}
 
-	Connection::PollAll();
+	if (Connection::PollAll())
+	{
+		xTaskNotify(mainTaskHdl, TFR_REQUEST, eSetBits);	// tell the SAM about the new socket events next time round
+	}
 
-	if (gpio_get_level(SamTfrReadyPin) == 1 &&
-		(flags == 0 || (flags & SAM_TFR_READY))) {
+	if (SamReadyForTransaction())
+	{
 		ProcessRequest();
+		RunPipelined();
 	}
+
+#if CONFIG_DWSS_READ_PREFETCH_BUFFERS
+	Connection::PrefetchReads();			// get the next reads ready while the SAM is busy elsewhere
+#endif
 }
 
 // End
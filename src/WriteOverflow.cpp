@@ -0,0 +1,120 @@
+/*
+ * WriteOverflow.cpp
+ *
+ * Shared pool of buffers holding write data that the SAM has handed over, but that lwIP could not accept at the time.
+ * Only the main task uses the pool, so it needs no locking.
+ */
+#include <cstring>
+#include <cstdlib>
+
+#include "rom/ets_sys.h"
+
+#include "WriteOverflow.h"
+#include "include/MessageFormats.h"		// for MaxDataLength
+
+WriteOverflow WriteOverflow::slots[NumWriteOverflowSlots];
+size_t WriteOverflow::numInUse = 0;
+size_t WriteOverflow::slotSize = MaxDataLength;
+
+uint32_t WriteOverflow::timesUsed = 0;
+uint32_t WriteOverflow::bytesStored = 0;
+uint32_t WriteOverflow::timesUnavailable = 0;
+size_t WriteOverflow::maxInUse = 0;
+
+// Give each slot room for a write of the default data length
+/*static*/ void WriteOverflow::Init()
+{
+	for (WriteOverflow& slot : slots)
+	{
+		slot.Resize();
+	}
+}
+
+// Make the slots hold writes of up to 'size' bytes, when the SAM negotiates a new data length.
+// A slot in use keeps its old buffer until it is released.
+/*static*/ void WriteOverflow::SetSlotSize(size_t size)
+{
+	slotSize = size;
+	for (WriteOverflow& slot : slots)
+	{
+		if (!slot.inUse && slot.capacity != slotSize)
+		{
+			slot.Resize();
+		}
+	}
+}
+
+// Return true if there is a free slot that can hold any write the SAM may send
+/*static*/ bool WriteOverflow::Available()
+{
+	for (const WriteOverflow& slot : slots)
+	{
+		if (!slot.inUse && slot.capacity >= slotSize)
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+// Replace the buffer with one of slotSize bytes. If there isn't enough heap for that, try to keep one of the default size.
+void WriteOverflow::Resize()
+{
+	free(data);
+	data = (uint8_t *)malloc(slotSize);
+	capacity = slotSize;
+	if (data == nullptr)
+	{
+		data = (uint8_t *)malloc(MaxDataLength);
+		capacity = (data == nullptr) ? 0 : MaxDataLength;
+	}
+}
+
+// Take a free slot and copy the data into it. Return nullptr if there is no free slot that can hold the data.
+/*static*/ WriteOverflow *WriteOverflow::Allocate(const uint8_t *src, size_t len, uint8_t netconnFlags)
+{
+	for (WriteOverflow& slot : slots)
+	{
+		if (!slot.inUse && len <= slot.capacity)
+		{
+			memcpy(slot.data, src, len);
+			slot.length = len;
+			slot.offset = 0;
+			slot.flags = netconnFlags;
+			slot.inUse = true;
+
+			++numInUse;
+			if (numInUse > maxInUse)
+			{
+				maxInUse = numInUse;
+			}
+			++timesUsed;
+			bytesStored += len;
+			return &slot;
+		}
+	}
+
+	++timesUnavailable;
+	return nullptr;
+}
+
+void WriteOverflow::Release()
+{
+	if (inUse)
+	{
+		inUse = false;
+		--numInUse;
+		if (capacity != slotSize)
+		{
+			Resize();
+		}
+	}
+}
+
+/*static*/ void WriteOverflow::Report()
+{
+	ets_printf("Write overflow: used %u times, %u bytes, unavailable %u times, %u/%u slots of %u bytes in use, max %u\n",
+				timesUsed, bytesStored, timesUnavailable, numInUse, NumWriteOverflowSlots, slotSize, maxInUse);
+}
+
+// End
@@ -0,0 +1,52 @@
+/*
+ * WriteOverflow.h
+ *
+ * Shared pool of buffers holding write data that the SAM has handed over, but that lwIP could not accept at the time.
+ * See the note about writing above Connection::Write.
+ */
+
+#ifndef SRC_WRITEOVERFLOW_H_
+#define SRC_WRITEOVERFLOW_H_
+
+#include <cstdint>
+#include <cstddef>
+
+#include "Config.h"
+
+class WriteOverflow
+{
+public:
+	const uint8_t *GetData() const { return data + offset; }
+	size_t Remaining() const { return length - offset; }
+	uint8_t GetFlags() const { return flags; }
+	void Consume(size_t amount) { offset += amount; }
+	void Release();
+
+	static void Init();
+	static void SetSlotSize(size_t size);
+	static bool Available();
+	static WriteOverflow *Allocate(const uint8_t *src, size_t len, uint8_t netconnFlags);
+	static void Report();
+
+private:
+	uint8_t *data;				// from the heap, as long as the largest write the SAM can send
+	size_t capacity;			// the length of data, which is less than slotSize until the slot has been resized
+	size_t length;
+	size_t offset;
+	uint8_t flags;				// the netconn write flags to use when sending the data
+	bool inUse;
+
+	void Resize();
+
+	static WriteOverflow slots[NumWriteOverflowSlots];
+	static size_t numInUse;
+	static size_t slotSize;
+
+	// Counters for the diagnostics report
+	static uint32_t timesUsed;
+	static uint32_t bytesStored;
+	static uint32_t timesUnavailable;
+	static size_t maxInUse;
+};
+
+#endif /* SRC_WRITEOVERFLOW_H_ */
@@ -20,19 +20,45 @@
  */
 #include <cmath>
 #include <string.h>
+#include <algorithm>
 
 #include "esp_attr.h"
 
 #include "esp32/spi.h"
 
 #include "esp_system.h"
+#include "esp_memory_utils.h"
 #include "driver/spi_master.h"
 #include "driver/gpio.h"
+#include "hal/spi_ll.h"
 
 #include "HSPI.h"
 #include "Config.h"
 
+static constexpr size_t QueueSize = 4;					// the number of transactions we can have queued at a time
+static constexpr uint32_t MinQueuedDwords = 16;			// shorter transfers are polled, because the interrupt costs more than the transfer
+static constexpr uint32_t MaxFastDwords = 16;			// the peripheral data buffer holds 64 bytes
+static constexpr size_t MinDirectBytes = 4 * MinQueuedDwords;	// shorter chunks of a scatter transfer are copied to the bounce buffer
+static constexpr size_t BounceBufferDwords = 64;
+
 static spi_device_handle_t spi;
+static spi_dev_t *hw;
+
+#if CONFIG_DWSS_SPI_FAST_PATH
+static bool fastPathEnabled = true;
+#else
+static bool fastPathEnabled = false;
+#endif
+static bool fastPathReady = false;						// true once the driver has set up clock, mode and bit order in the peripheral
+
+static DMA_ATTR uint32_t bounceBuffer[BounceBufferDwords];	// holds the pieces of a scatter transfer that are not sent from where they are
+
+// Transaction descriptors are set up once, so that we don't need to clear one for every transfer
+static spi_transaction_t dwordTrans;					// used by transfer32
+static spi_transaction_t polledTrans;					// used for short transfers
+static spi_transaction_t queuedTrans[QueueSize];		// used for transfers that are queued for the driver to do by DMA
+static size_t nextQueuedTrans = 0;
+static size_t numQueuedTrans = 0;
 
 static void clockCtrl2Cfg(uint32_t val, spi_device_interface_config_t *devcfg)
 {
@@ -67,7 +93,7 @@ void HSPIClass::InitMaster(uint8_t mode, uint32_t clockReg, bool msbFirst)
 	buscfg.sclk_io_num = SCK;
 	buscfg.quadwp_io_num = -1;
 	buscfg.quadhd_io_num = -1;
-	buscfg.max_transfer_sz = 0; // use default val
+	buscfg.max_transfer_sz = MaxSpiDataLength;	// the default is too small for a negotiated large frame
 	buscfg.flags = SPICOMMON_BUSFLAG_MASTER;
 	buscfg.intr_flags = ESP_INTR_FLAG_IRAM;
 
@@ -76,7 +102,7 @@ void HSPIClass::InitMaster(uint8_t mode, uint32_t clockReg, bool msbFirst)
 	devcfg.mode = mode;
 	devcfg.spics_io_num = -1;
 	devcfg.flags = SPI_DEVICE_NO_DUMMY | (!msbFirst ? SPI_DEVICE_BIT_LSBFIRST : 0);
-	devcfg.queue_size = 4;
+	devcfg.queue_size = QueueSize;
 
 	clockCtrl2Cfg(clockReg, &devcfg);
 
@@ -84,10 +110,21 @@ void HSPIClass::InitMaster(uint8_t mode, uint32_t clockReg, bool msbFirst)
 	spi_bus_add_device(MSPI, &devcfg, &spi);
 
 	spi_device_acquire_bus(spi, portMAX_DELAY);
+
+	memset(&dwordTrans, 0, sizeof(dwordTrans));
+	dwordTrans.length = 32;
+	dwordTrans.flags = SPI_TRANS_USE_TXDATA | SPI_TRANS_USE_RXDATA;
+	memset(&polledTrans, 0, sizeof(polledTrans));
+	memset(queuedTrans, 0, sizeof(queuedTrans));
+	nextQueuedTrans = numQueuedTrans = 0;
+
+	hw = SPI_LL_GET_HW(MSPI);
+	fastPathReady = false;
 }
 
 void HSPIClass::end()
 {
+	flush();
 	spi_device_release_bus(spi);
 	spi_bus_remove_device(spi);
 	spi_bus_free(MSPI);
@@ -100,6 +137,7 @@ void IRAM_ATTR HSPIClass::beginTransaction()
 
 void IRAM_ATTR HSPIClass::endTransaction()
 {
+	flush();
 }
 
 void HSPIClass::setClockDivider(uint32_t clockDiv)
@@ -110,15 +148,124 @@ void HSPIClass::setDataBits(uint16_t bits)
 {
 }
 
+// Enable or disable the direct register path for short transfers, so that its saving can be measured
+void HSPIClass::setFastPath(bool enable)
+{
+	fastPathEnabled = enable;
+}
+
+/**
+ * Do a short transfer by driving the peripheral registers directly.
+ * When the bus has a DMA channel the driver sets up DMA descriptors even for a single dword, which costs more than the transfer
+ * itself. The clock, mode and bit order are those left in the peripheral by the last transaction that the driver did for us.
+ * Any queued transfers must have been flushed first.
+ * @param out const void *
+ * @param in  void *
+ * @param length size_t, the number of bytes, at most 4 * MaxFastDwords
+ */
+static inline void IRAM_ATTR fastTransfer(const void * out, void * in, size_t length)
+{
+	const size_t bits = 8 * length;
+	spi_ll_dma_tx_enable(hw, false);
+	spi_ll_dma_rx_enable(hw, false);
+	spi_ll_set_mosi_bitlen(hw, bits);
+	spi_ll_set_miso_bitlen(hw, bits);
+	spi_ll_enable_mosi(hw, 1);
+	spi_ll_enable_miso(hw, 1);
+	if (out)
+	{
+		spi_ll_write_buffer(hw, (const uint8_t *)out, bits);
+	}
+	spi_ll_clear_int_stat(hw);
+	spi_ll_apply_config(hw);
+	spi_ll_user_start(hw);
+	while (!spi_ll_usr_is_done(hw)) { }
+	if (in)
+	{
+		spi_ll_read_buffer(hw, (uint8_t *)in, bits);
+	}
+}
+
+static inline bool useFastPath(size_t length)
+{
+	return length <= 4 * MaxFastDwords && fastPathEnabled && fastPathReady;
+}
+
+// Wait for all queued transfers to complete
+static void IRAM_ATTR flushQueue()
+{
+	while (numQueuedTrans != 0)
+	{
+		spi_transaction_t *done;
+		spi_device_get_trans_result(spi, &done, portMAX_DELAY);
+		--numQueuedTrans;
+	}
+}
+
+// Do a short transfer through the driver without using the interrupt. Any queued transfers must have been flushed first.
+static void IRAM_ATTR polledTransfer(const void * out, void * in, size_t length)
+{
+	polledTrans.length = 8 * length;
+	polledTrans.tx_buffer = out;
+	polledTrans.rx_buffer = in;
+	polledTrans.rxlength = (in) ? polledTrans.length : 0;
+	spi_device_polling_transmit(spi, &polledTrans);
+	fastPathReady = true;
+}
+
+// Queue a transfer for the driver to do by DMA, waiting for a free descriptor if necessary
+static void IRAM_ATTR queueTransfer(const void * out, void * in, size_t length)
+{
+	if (numQueuedTrans == QueueSize)
+	{
+		spi_transaction_t *done;
+		spi_device_get_trans_result(spi, &done, portMAX_DELAY);
+		--numQueuedTrans;
+	}
+
+	spi_transaction_t& trans = queuedTrans[nextQueuedTrans];
+	nextQueuedTrans = (nextQueuedTrans + 1) % QueueSize;
+	trans.length = 8 * length;
+	trans.tx_buffer = out;
+	trans.rx_buffer = in;
+	trans.rxlength = (in) ? trans.length : 0;
+	spi_device_queue_trans(spi, &trans, portMAX_DELAY);
+	++numQueuedTrans;
+}
+
+// Send part of a longer transfer by whichever means is cheapest. The data must remain valid until the queue has been flushed.
+static void IRAM_ATTR sendBytes(const uint8_t * out, size_t length)
+{
+	if (useFastPath(length))
+	{
+		flushQueue();
+		fastTransfer(out, nullptr, length);
+	}
+	else if (length < 4 * MinQueuedDwords)
+	{
+		flushQueue();
+		polledTransfer(out, nullptr, length);
+	}
+	else
+	{
+		queueTransfer(out, nullptr, length);
+	}
+}
+
 uint32_t IRAM_ATTR HSPIClass::transfer32(uint32_t data)
 {
-	spi_transaction_t trans;
-	memset(&trans, 0, sizeof(trans));
-	trans.length = 32;
-	*((uint32_t*)trans.tx_data) = data;
-	trans.flags |= SPI_TRANS_USE_TXDATA | SPI_TRANS_USE_RXDATA;
-	spi_device_polling_transmit(spi, &trans);
-	return *((uint32_t*)trans.rx_data);
+	flushQueue();
+	if (useFastPath(sizeof(data)))
+	{
+		uint32_t result;
+		fastTransfer(&data, &result, sizeof(data));
+		return result;
+	}
+
+	*((uint32_t*)dwordTrans.tx_data) = data;
+	spi_device_polling_transmit(spi, &dwordTrans);
+	fastPathReady = true;
+	return *((uint32_t*)dwordTrans.rx_data);
 }
 
 /**
@@ -132,21 +279,113 @@ void IRAM_ATTR HSPIClass::transferDwords(const uint32_t * out, uint32_t * in, ui
 		return;
 	}
 
-	spi_transaction_t trans;
-	memset(&trans, 0, sizeof(trans));
-	trans.length = 8 * 4 * size;
+	if (useFastPath(4 * size))
+	{
+		flushQueue();
+		fastTransfer(out, in, 4 * size);
+	}
+	else if (size < MinQueuedDwords)
+	{
+		flushQueue();
+		polledTransfer(out, in, 4 * size);
+	}
+	else
+	{
+		queueTransfer(out, in, 4 * size);
+		flushQueue();
+	}
+}
 
-	if (out) {
-		trans.tx_buffer = out;
+/**
+ * Start a transfer and return without waiting for it to complete, so that the caller can get on with something else.
+ * The buffers must remain valid until flush() has been called. Short transfers are done immediately.
+ * @param out uint32_t *
+ * @param in  uint32_t *
+ * @param size uint32_t
+ */
+void IRAM_ATTR HSPIClass::queueDwords(const uint32_t * out, uint32_t * in, uint32_t size)
+{
+	if (size < MinQueuedDwords || useFastPath(4 * size))
+	{
+		transferDwords(out, in, size);
+		return;
 	}
+	queueTransfer(out, in, 4 * size);
+}
 
-	if (in)
+/**
+ * Send a list of chunks back to back, followed by padding to a whole number of dwords, and wait for it to complete.
+ * Long chunks in DMA-capable memory are sent from where they are. Their unaligned ends, short chunks and the padding
+ * are gathered into the bounce buffer, so that the driver sees only dword-aligned buffers and never has to copy them itself.
+ * @param chunks const SpiChunk *
+ * @param numChunks size_t
+ */
+void IRAM_ATTR HSPIClass::transferScatter(const SpiChunk *chunks, size_t numChunks)
+{
+	uint8_t * const bounce = reinterpret_cast<uint8_t *>(bounceBuffer);
+	size_t bounceStart = 0;					// start of the bounced data that has not been sent yet
+	size_t bounceEnd = 0;					// end of the bounced data
+	size_t total = 0;
+
+	auto sendBounced = [&]()
+	{
+		if (bounceEnd != bounceStart)
+		{
+			sendBytes(bounce + bounceStart, bounceEnd - bounceStart);
+			bounceEnd = (bounceEnd + 3) & ~3;			// keep the next piece dword aligned
+			bounceStart = bounceEnd;
+		}
+	};
+
+	auto bounceBytes = [&](const uint8_t *data, size_t length)
+	{
+		while (length != 0)
+		{
+			if (bounceEnd == sizeof(bounceBuffer))
+			{
+				sendBounced();
+				flushQueue();						// the bounce buffer is in use until its data has been sent
+				bounceStart = bounceEnd = 0;
+			}
+			const size_t n = std::min<size_t>(length, sizeof(bounceBuffer) - bounceEnd);
+			memcpy(bounce + bounceEnd, data, n);
+			bounceEnd += n;
+			data += n;
+			length -= n;
+		}
+	};
+
+	for (size_t i = 0; i < numChunks; ++i)
 	{
-		trans.rx_buffer = in;
-		trans.rxlength = trans.length;
+		const uint8_t *data = chunks[i].data;
+		size_t length = chunks[i].length;
+		total += length;
+		if (length >= MinDirectBytes && esp_ptr_dma_capable(data))
+		{
+			const size_t head = (-(uintptr_t)data) & 3;
+			bounceBytes(data, head);
+			data += head;
+			length -= head;
+			sendBounced();
+
+			const size_t body = length & ~3;
+			sendBytes(data, body);
+			data += body;
+			length -= body;
+		}
+		bounceBytes(data, length);
 	}
 
-	spi_device_polling_transmit(spi, &trans);
+	static const uint8_t padding[3] = { 0, 0, 0 };
+	bounceBytes(padding, (-total) & 3);
+	sendBounced();
+	flushQueue();
+}
+
+// Wait for all queued transfers to complete
+void IRAM_ATTR HSPIClass::flush()
+{
+	flushQueue();
 }
 
 void IRAM_ATTR HSPIClass::transferDwords_(const uint32_t * out, uint32_t * in, uint8_t size)
@@ -19,6 +19,8 @@
  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
  */
 #include <cmath>
+#include <string.h>
+#include <algorithm>
 
 #include "esp_attr.h"
 
@@ -163,6 +165,52 @@ void IRAM_ATTR HSPIClass::transferDwords(const uint32_t * out, uint32_t * in, ui
 	}
 }
 
+// There is no DMA on the ESP8266, so a queued transfer is done immediately
+void IRAM_ATTR HSPIClass::queueDwords(const uint32_t * out, uint32_t * in, uint32_t size) {
+	transferDwords(out, in, size);
+}
+
+/**
+ * Send a list of chunks back to back, followed by padding to a whole number of dwords.
+ * The data has to be copied into the W registers anyway, so it is gathered in a staging buffer of the same size.
+ * @param chunks const SpiChunk *
+ * @param numChunks size_t
+ */
+void IRAM_ATTR HSPIClass::transferScatter(const SpiChunk *chunks, size_t numChunks) {
+	uint32_t staging[16];
+	uint8_t * const stagingBytes = reinterpret_cast<uint8_t *>(staging);
+	size_t staged = 0;
+
+	for (size_t i = 0; i < numChunks; ++i) {
+		const uint8_t *data = chunks[i].data;
+		size_t length = chunks[i].length;
+		while (length != 0) {
+			const size_t n = std::min<size_t>(length, sizeof(staging) - staged);
+			memcpy(stagingBytes + staged, data, n);
+			staged += n;
+			data += n;
+			length -= n;
+			if (staged == sizeof(staging)) {
+				transferDwords_(staging, nullptr, 16);
+				staged = 0;
+			}
+		}
+	}
+
+	if (staged != 0) {
+		memset(stagingBytes + staged, 0, (-staged) & 3);
+		transferDwords_(staging, nullptr, (staged + 3)/4);
+	}
+}
+
+void IRAM_ATTR HSPIClass::flush() {
+	while(REG(SPI_CMD(MSPI)) & SPI_USR) {}
+}
+
+// All transfers already drive the registers directly
+void HSPIClass::setFastPath(bool enable) {
+}
+
 void IRAM_ATTR HSPIClass::transferDwords_(const uint32_t * out, uint32_t * in, uint8_t size) {
 	while(REG(SPI_CMD(MSPI)) & SPI_USR) {}
 
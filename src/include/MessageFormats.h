@@ -18,13 +18,15 @@
 const size_t SsidLength = 32;
 const size_t PasswordLength = 64;
 const size_t HostNameLength = 64;
-const size_t MaxDataLength = 2048;						// maximum length of the data part of an SPI exchange
-const size_t MaxConnections = 8;						// the number of simultaneous connections we support
+const size_t MaxDataLength = 2048;						// maximum length of the data part of an SPI exchange, unless a larger one has been negotiated
+const size_t MaxConnections = 8;						// the number of simultaneous connections we support, unless the SAM selects more with networkSetNumSockets
+const size_t MaxWideConnections = 32;					// the most connections that the 32-bit socket bitmaps can describe
 const unsigned int NumWiFiTcpSockets = MaxConnections;	// the number of concurrent TCP/IP connections supported
 
 static_assert(MaxDataLength % sizeof(uint32_t) == 0, "MaxDataLength must be a whole number of dwords");
 
 const uint8_t MyFormatVersion = 0x3E;
+const uint8_t BatchFormatVersion = 0xB1;				// format version of a batched request, see BatchRequestHeader
 const uint8_t InvalidFormatVersion = 0xC9;				// must be different from any format version we have ever used
 
 const uint32_t AnyIp = 0;								// must be the same as AcceptAnyIp in NetworkDefs.h
@@ -72,6 +74,16 @@ enum class NetworkCommand : uint8_t
 	networkStartScan,           // start a scan for APs the module can connect to
 	networkGetScanResult,       // get the results of the previously started scan
 	networkAddEnterpriseSsid,	// add an enterprise ssid and its credentials
+
+	// Added at version 2.4
+	connGetAllStatus,			// get the status of all connections and the summary status in a single exchange
+	networkSetMaxDataLength,	// set the maximum length of the data part of later exchanges to param32, see MessageHeaderEspToSam::maxDataLength
+	connGetEvents,				// get and clear the bitmaps of sockets on which something has happened since the last connGetEvents
+	networkSetNumSockets,		// set the number of sockets to param32, see MessageHeaderEspToSam::numSockets
+	connSetOptions,				// set TCP options for a connected socket, data is a ConnOptionsData
+	networkSetIdleTimeouts,		// set how long sockets of each protocol may be idle before we reap them, data is an IdleTimeoutsData
+	connGetStats,				// get the traffic statistics of a socket
+	networkGetJobStatus,		// get the progress of the Wi-Fi jobs that networkStartClient, networkStartAccessPoint and networkStop start
 };
 
 // Message header sent from the SAM to the ESP
@@ -88,6 +100,7 @@ struct MessageHeaderSamToEsp
 
 	static const uint8_t FlagCloseAfterWrite = 0x01;
 	static const uint8_t FlagPush = 0x02;
+	static const uint8_t FlagPipelined = 0x04;	// see the description of pipelined commands below
 };
 
 const size_t headerDwords = NumDwords(sizeof(MessageHeaderSamToEsp));
@@ -125,19 +138,58 @@ struct WiFiScanData
 
 // Message data sent from SAM to ESP for a connCreate, networkListen or networkStopListening command
 // For a networkStopListening command, only the port number is used
+// priority and reservedConnections were padding and the high byte of a 16-bit maxConnections, so older SAM firmware sends 0 for them.
 struct ListenOrConnectData
 {
 	uint32_t remoteIp;			// IP address to listen for, 0 means any
 	uint8_t protocol;			// Protocol for this connection (0 = HTTP, 1 = FTP, 2 = TELNET, 3 = FTP-DATA) - also see NetworkDefs.h
-	uint8_t dummy;				// To ensure alignment is the same on ESP8266 and SAM
+	uint8_t priority;			// if listening, waiting connections on higher priority listeners get free sockets first
 	uint16_t port;				// port number to listen on if connection is incoming, or to connect to if outgoing
-	uint16_t maxConnections;	// maximum number of connections to accept if listening
+	uint8_t maxConnections;		// maximum number of connections to accept if listening
+	uint8_t reservedConnections;	// if listening, how many of those connections other listeners can't take the sockets for
+};
+
+// Message data sent from SAM to ESP for a connCreate command that names the host or sets a timeout.
+// The SAM sets dataLength to the size of this to use it, otherwise it sends just the ListenOrConnectData.
+struct ConnCreateData
+{
+	ListenOrConnectData lcData;
+	uint16_t timeout;			// milliseconds to wait for the connection including the name lookup, 0 for the default
+	uint16_t dummy;
+	char hostName[HostNameLength];	// host to look up and connect to instead of remoteIp, null terminated unless it is the full length
+};
+
+static_assert(sizeof(ConnCreateData) % sizeof(uint32_t) == 0, "ConnCreateData must be a whole number of dwords");
+
+// Message data sent from SAM to ESP with connSetOptions. The options last until the socket is closed.
+struct ConnOptionsData
+{
+	uint8_t flags;				// see below
+	uint8_t keepAliveCount;		// how many keepalive probes to send before giving up, 0 to leave unchanged
+	uint16_t sendBufferLimit;	// the most write data that may be waiting to be sent or acknowledged, 0 for no limit
+	uint32_t keepAliveIdle;		// milliseconds without traffic before sending a keepalive probe, 0 to leave unchanged
+	uint32_t keepAliveInterval;	// milliseconds between keepalive probes, 0 to leave unchanged
+	uint16_t ackThreshold;		// how many bytes the SAM must read before we open the receive window, 0 for the default of one MSS
+	uint16_t dummy;
+
+	static const uint8_t FlagNoDelay = 0x01;		// disable the Nagle algorithm, for interactive traffic
+	static const uint8_t FlagKeepAlive = 0x02;		// send keepalive probes, so that a dead peer is noticed
 };
 
 const uint8_t protocolHTTP = 0;
 const uint8_t protocolFTP = 1;
 const uint8_t protocolTelnet = 2;
 const uint8_t protocolFtpData = 3;
+const size_t NumProtocols = 4;
+
+// Message data sent from SAM to ESP with networkSetIdleTimeouts.
+// A connected socket with no traffic for its protocol's timeout is aborted. If the SAM then leaves it in that state, or in
+// otherEndClosed, for the same time again, it is freed. Reaped sockets are reported in AllConnStatusResponse::reapedSockets.
+// No sockets are reaped until the SAM sends this.
+struct IdleTimeoutsData
+{
+	uint16_t timeouts[NumProtocols];	// seconds, indexed by protocol, 0 means never
+};
 
 const size_t MaxCredentialChunkSize = MaxDataLength;
 
@@ -227,9 +279,18 @@ struct MessageHeaderEspToSam
 {
 	uint8_t formatVersion;
 	WiFiState state;
-	uint8_t dummy[2];
-	uint32_t dummy32;
+	uint8_t capabilities;			// optional protocol features supported by the ESP, zero in older firmware
+	uint8_t numSockets;				// the most sockets that networkSetNumSockets can select, zero in older firmware
+	uint16_t maxDataLength;			// the largest data length that networkSetMaxDataLength can select, zero in older firmware
+	uint16_t dummy16;
 	int32_t response;				// response length if positive, or error code if negative
+
+	static const uint8_t CapabilityBatch = 0x01;			// the ESP accepts batched requests
+	static const uint8_t CapabilityLargeFrames = 0x02;		// the ESP accepts networkSetMaxDataLength
+	static const uint8_t CapabilityEvents = 0x04;			// the ESP requests a transfer when there are socket events to fetch with connGetEvents
+	static const uint8_t CapabilityManySockets = 0x08;		// the ESP accepts networkSetNumSockets and can return 32-bit socket bitmaps
+	static const uint8_t CapabilityConnectByName = 0x10;	// the ESP accepts ConnCreateData with connCreate
+	static const uint8_t CapabilityPipelined = 0x20;		// the ESP accepts FlagPipelined
 };
 
 static_assert(sizeof(MessageHeaderSamToEsp) == sizeof(MessageHeaderEspToSam), "Message header sizes don't match");
@@ -324,8 +385,118 @@ struct ConnStatusResponse
 	uint16_t writeBufferSpace;
 	uint16_t connectedSockets;			// bitmap of sockets that are in state 'connected'
 	uint16_t otherEndClosedSockets;		// bitmap of sockets that are in state 'otherEndClosed'
+
+	// Added at version 2.4. These are only sent if the SAM has room for them, so older SAM firmware gets the fields above only.
+	uint32_t connectedSocketsWide;		// bitmap of sockets that are in state 'connected', for up to MaxWideConnections sockets
+	uint32_t otherEndClosedSocketsWide;	// bitmap of sockets that are in state 'otherEndClosed', for up to MaxWideConnections sockets
+};
+
+// Statistics of one socket, returned by connGetStats. They are reset when the socket connects.
+struct ConnStatsResponse
+{
+	uint32_t bytesIn;					// bytes received
+	uint32_t bytesOut;					// bytes that the SAM has given us to send
+	uint32_t pbufsIn;					// lwIP buffers received
+	uint32_t writeFailures;				// writes that failed, or that we could not take all the data of
+	uint32_t overflows;					// times that lwIP could not take all the data we had for it, so that some had to wait
+	uint32_t firstByteMillis;			// milliseconds from connecting to receiving the first data, UINT32_MAX if none yet
+	uint32_t closePendingMillis;		// milliseconds that closing waited for the remaining data to be sent, 0 if it didn't wait
+	uint32_t retransmits;				// segment retransmissions seen on the pcb, sampled so that some may be missed
+};
+
+// Progress of the Wi-Fi jobs, returned by networkGetJobStatus.
+// networkStartClient, networkStartAccessPoint and networkStop return as soon as their job is queued, and the ESP carries on serving requests
+// while it runs. networkStartClient and networkStartAccessPoint are refused with ResponseBusy until the jobs before them have finished,
+// and so are the commands that change the stored SSIDs (networkAddSsid, networkAddEnterpriseSsid, networkConfigureAccessPoint,
+// networkDeleteSsid and networkFactoryReset), because a job may be reading them.
+struct JobStatusResponse
+{
+	uint32_t jobsQueued;		// how many jobs have been queued since the ESP started
+	uint32_t jobsDone;			// how many of them have finished, so none are waiting or running when this equals jobsQueued
+	uint32_t lastJobMillis;		// how long the last job to finish took
+	uint8_t runningCommand;		// the NetworkCommand of the job that is running, or nullCommand
+	uint8_t lastCommand;		// the NetworkCommand of the last job to finish
+	uint8_t lastJobFailed;		// non-zero if the last job to finish set the last error, which networkGetLastError returns
+	uint8_t dummy;
+};
+
+// Socket events returned by connGetEvents. Each bitmap has a bit set for every socket on which that event has happened
+// at least once since the previous connGetEvents. The SAM should fetch the status of those sockets and service them.
+// The ESP only records events, and requests transfers for them, after the SAM's first connGetEvents, which may return no events.
+struct ConnEventsResponse
+{
+	uint32_t connectedSockets;			// sockets that have become connected
+	uint32_t readableSockets;			// sockets that have received data after having none waiting to be read
+	uint32_t writableSockets;			// sockets that have gained write space after having none
+	uint32_t closedSockets;				// sockets that the other end has closed or that have been aborted
+};
+
+// Status of all connections, returned by connGetAllStatus.
+// The summary bitmaps and RSSI are sent once. They are not filled in within the per-socket entries.
+// Only the first numSockets entries of the sockets array are sent.
+struct AllConnStatusResponse
+{
+	uint32_t connectedSockets;			// bitmap of sockets that are in state 'connected'
+	uint32_t otherEndClosedSockets;		// bitmap of sockets that are in state 'otherEndClosed'
+	int8_t rssi;						// signal strength
+	uint8_t numSockets;					// the number of entries in the sockets array
+	uint8_t dummy[2];
+	uint32_t reapedSockets;				// bitmap of sockets that have been reaped since the last connGetAllStatus
+	ConnStatusResponse sockets[MaxWideConnections];
 };
 
+static_assert(sizeof(AllConnStatusResponse) <= MaxDataLength, "AllConnStatusResponse too large");
+
+// Batched requests
+// If the ESP reports CapabilityBatch in its header, the SAM may send a header with formatVersion set to BatchFormatVersion in order to execute
+// several connection commands in one transaction. The command, socketNumber, flags and param32 fields of the header are not used.
+// dataLength is the length of the request block and dataBufferAvailable is the space the SAM has for the reply block.
+// The ESP sends the response dword (ResponseEmpty, or an error code), then receives the request block, executes the sub-commands and sends the reply block.
+// So the reply block starts NumDwords(dataLength) dwords after the response dword.
+// The request block is a BatchRequestHeader, then numCommands BatchSubCommand entries, then the data for each connWrite sub-command in turn,
+// each padded to a whole number of dwords.
+// The reply block is a BatchReplyHeader, then numCommands int32_t responses, then the data returned by each sub-command in turn,
+// each padded to a whole number of dwords. A response has the same meaning as it has for the equivalent unbatched command,
+// except that for connWrite it is the amount of data accepted, and any data not accepted is discarded.
+// Only connAbort, connClose, connRead, connWrite, connGetStatus, connGetAllStatus, connGetEvents and connGetStats may be batched.
+// The connWrite sub-commands are executed first.
+// If the request block is malformed, or dataBufferAvailable is too small for the BatchReplyHeader and responses, none of the
+// sub-commands is executed and the reply block is just a BatchReplyHeader with numResponses set to zero.
+// If dataBufferAvailable is too small even for that, the response dword is ResponseBufferTooSmall and there is no reply block.
+const size_t MaxBatchCommands = 16;
+
+struct BatchRequestHeader
+{
+	uint8_t numCommands;
+	uint8_t dummy[3];
+};
+
+struct BatchSubCommand
+{
+	NetworkCommand command;
+	uint8_t socketNumber;
+	uint8_t flags;					// as in MessageHeaderSamToEsp
+	uint8_t dummy;
+	uint16_t dataLength;			// how much write data there is for this sub-command
+	uint16_t dataBufferAvailable;	// how much data the SAM can receive for this sub-command
+};
+
+struct BatchReplyHeader
+{
+	uint8_t numResponses;
+	uint8_t dummy;
+	uint16_t dataLength;			// length of the reply block including this header
+};
+
+// Pipelined commands
+// If the ESP reports CapabilityPipelined in its header, the SAM may set FlagPipelined in the header of connGetStatus, connGetAllStatus,
+// connGetEvents or connGetStats with no request data, or of nullCommand. The response dword and the data that follows it are then the result of
+// the previous pipelined command, which the ESP worked out after that transaction ended, so the SAM does not wait for it on the bus.
+// The command is executed with the dataBufferAvailable that came with it, so the SAM must offer at least as much when it collects the result.
+// If it offers less, the response is ResponseBufferTooSmall, the new command is ignored and the ESP keeps the result to send again.
+// If there is no previous result, the response is ResponseEmpty. The ESP keeps the new command to execute after this transaction,
+// except for nullCommand, which the SAM uses to collect the last result. Other commands may be sent in between without losing the result.
+
 // Response error codes. A non-negative code is the number of bytes of returned data.
 const int32_t ResponseEmpty = 0;				// used when there is no error and no data to return
 const int32_t ResponseUnknownCommand = -1;